@@ -0,0 +1,266 @@
+/*
+ * Drives concurrent FTP logins against a proftpd with mod_auth_web
+ * loaded, and reports logins per second and login latency percentiles.
+ *
+ * Each of the -c threads repeatedly connects, sends USER and PASS, waits
+ * for the verdict and sends QUIT, until -n logins have been made. Latency
+ * is measured from connect() to the reply to PASS.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *host = "127.0.0.1", *port = "21";
+static const char *user_pattern = "user%u", *password = "secret";
+static unsigned int concurrency = 100, total = 1000, nusers = 0;
+static int timeout_secs = 30;
+
+static struct addrinfo *server;
+static unsigned int next_login;
+static unsigned int accepted, rejected, errors;
+static int64_t *latencies;
+
+struct ftp_conn {
+	int fd;
+	char buf[4096];
+	size_t used;
+};
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-h host] [-p port] [-c concurrency] [-n logins]\n"
+		"       [-u user-pattern] [-U distinct-users] [-P password] [-t timeout]\n"
+		"\n"
+		"user-pattern is a printf format taking the login number, modulo\n"
+		"distinct-users when given, such as 'user%%u@example.com'.\n", prog);
+	exit(2);
+}
+
+static int64_t
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Reads one reply, skipping the lines of a multi-line one, and returns
+ * its code, or -1.
+ */
+static int
+ftp_reply(struct ftp_conn *conn)
+{
+	char *eol, *line;
+	ssize_t n;
+	int code;
+
+	for (;;) {
+		while (!(eol = memchr(conn->buf, '\n', conn->used))) {
+			if (conn->used == sizeof(conn->buf)) {
+				return -1;
+			}
+			n = read(conn->fd, conn->buf + conn->used, sizeof(conn->buf) - conn->used);
+			if (n <= 0) {
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				return -1;
+			}
+			conn->used += n;
+		}
+
+		line = conn->buf;
+		code = eol - line >= 4 && line[3] == ' ' ? atoi(line) : 0;
+		conn->used -= eol + 1 - conn->buf;
+		memmove(conn->buf, eol + 1, conn->used);
+		if (code > 0) {
+			return code;
+		}
+	}
+}
+
+static int
+ftp_command(struct ftp_conn *conn, const char *cmd, const char *arg)
+{
+	char line[1024];
+	int len = snprintf(line, sizeof(line), "%s%s%s\r\n", cmd, arg ? " " : "",
+		arg ? arg : "");
+
+	if (len < 0 || (size_t) len >= sizeof(line) ||
+	    write(conn->fd, line, len) != len) {
+		return -1;
+	}
+	return ftp_reply(conn);
+}
+
+/* Returns the reply code to PASS, or -1. */
+static int
+ftp_login(unsigned int n)
+{
+	struct ftp_conn conn;
+	struct timeval tv;
+	char user[512];
+	int code = -1, on = 1;
+
+	snprintf(user, sizeof(user), user_pattern, nusers ? n % nusers : n);
+
+	conn.used = 0;
+	conn.fd = socket(server->ai_family, server->ai_socktype, server->ai_protocol);
+	if (conn.fd < 0) {
+		return -1;
+	}
+	tv.tv_sec = timeout_secs;
+	tv.tv_usec = 0;
+	setsockopt(conn.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(conn.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	if (connect(conn.fd, server->ai_addr, server->ai_addrlen) == 0 &&
+	    ftp_reply(&conn) == 220 &&
+	    ftp_command(&conn, "USER", user) == 331) {
+		code = ftp_command(&conn, "PASS", password);
+		if (code > 0) {
+			ftp_command(&conn, "QUIT", NULL);
+		}
+	}
+	close(conn.fd);
+	return code;
+}
+
+static void *
+ftp_worker(void *arg)
+{
+	unsigned int n;
+	int64_t start;
+	int code;
+
+	while ((n = __sync_fetch_and_add(&next_login, 1)) < total) {
+		start = now_usec();
+		code = ftp_login(n);
+		latencies[n] = now_usec() - start;
+
+		if (code == 230) {
+			__sync_fetch_and_add(&accepted, 1);
+		} else if (code == 530) {
+			__sync_fetch_and_add(&rejected, 1);
+		} else {
+			__sync_fetch_and_add(&errors, 1);
+			latencies[n] = -1;
+		}
+	}
+	return NULL;
+}
+
+static int
+cmp_latency(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+report(int64_t elapsed)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	unsigned int n = 0, i;
+
+	for (i = 0; i < total; ++i) {
+		if (latencies[i] >= 0) {
+			latencies[n++] = latencies[i];
+		}
+	}
+	qsort(latencies, n, sizeof(*latencies), cmp_latency);
+
+	printf("logins:      %u (%u accepted, %u rejected, %u errors)\n",
+		total, accepted, rejected, errors);
+	printf("elapsed:     %.3f s\n", elapsed / 1e6);
+	printf("logins/sec:  %.1f\n", n * 1e6 / (elapsed > 0 ? elapsed : 1));
+	if (n == 0) {
+		return;
+	}
+	for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i) {
+		printf("p%-11g %.3f ms\n", quantiles[i] * 100,
+			latencies[(unsigned int) (quantiles[i] * (n - 1))] / 1000.0);
+	}
+	printf("max:         %.3f ms\n", latencies[n - 1] / 1000.0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct addrinfo hints;
+	pthread_attr_t attr;
+	pthread_t *threads;
+	int64_t start;
+	unsigned int i;
+	int opt, res;
+
+	while ((opt = getopt(argc, argv, "h:p:c:n:u:U:P:t:")) != -1) {
+		switch (opt) {
+		case 'h': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 'c': concurrency = strtoul(optarg, NULL, 10); break;
+		case 'n': total = strtoul(optarg, NULL, 10); break;
+		case 'u': user_pattern = optarg; break;
+		case 'U': nusers = strtoul(optarg, NULL, 10); break;
+		case 'P': password = optarg; break;
+		case 't': timeout_secs = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (concurrency == 0 || total == 0) {
+		usage(argv[0]);
+	}
+	if (concurrency > total) {
+		concurrency = total;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	res = getaddrinfo(host, port, &hints, &server);
+	if (res != 0) {
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(res));
+		return 1;
+	}
+
+	latencies = calloc(total, sizeof(*latencies));
+	threads = calloc(concurrency, sizeof(*threads));
+	if (!latencies || !threads) {
+		perror("calloc");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 64 * 1024);
+
+	start = now_usec();
+	for (i = 0; i < concurrency; ++i) {
+		if (pthread_create(&threads[i], &attr, ftp_worker, NULL) != 0) {
+			fprintf(stderr, "unable to start thread %u\n", i);
+			concurrency = i;
+			break;
+		}
+	}
+	for (i = 0; i < concurrency; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	report(now_usec() - start);
+	return errors > 0;
+}
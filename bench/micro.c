@@ -0,0 +1,425 @@
+/*
+ * Micro-benchmarks for mod_auth_web's per-login hot paths: form encoding
+ * of credentials, matching AuthWebLoginFailedString in response bodies,
+ * and matching AuthWebRequireHeader in response headers. Each is timed
+ * against the implementation the module started from.
+ *
+ * The module is included directly, so its static functions can be
+ * called. Only the few ProFTPD functions these paths use are provided
+ * here; see Makefile.
+ */
+
+#include "../mod_auth_web.c"
+
+#include <stdarg.h>
+#include <time.h>
+
+/* The module reads session.pool, among other parts of the session. */
+session_t session;
+
+/* A bump allocator stands in for ProFTPD pools; it is emptied between
+ * iterations.
+ */
+static char arena[64 * 1024 * 1024];
+static size_t arena_used;
+
+static void
+arena_reset(void)
+{
+	arena_used = 0;
+}
+
+void *
+palloc(pool *p, size_t len)
+{
+	void *mem;
+
+	len = (len + 15) & ~(size_t) 15;
+	if (arena_used + len > sizeof(arena)) {
+		fprintf(stderr, "benchmark arena exhausted\n");
+		exit(1);
+	}
+	mem = arena + arena_used;
+	arena_used += len;
+	return mem;
+}
+
+void *
+pcalloc(pool *p, size_t len)
+{
+	return memset(palloc(p, len), 0, len);
+}
+
+char *
+pstrndup(pool *p, const char *str, size_t len)
+{
+	char *dup = palloc(p, len + 1);
+
+	memcpy(dup, str, len);
+	dup[len] = 0;
+	return dup;
+}
+
+char *
+pstrdup(pool *p, const char *str)
+{
+	return pstrndup(p, str, strlen(str));
+}
+
+char *
+pstrcat(pool *p, ...)
+{
+	va_list ap;
+	const char *str;
+	char *res, *track;
+	size_t len = 0;
+
+	va_start(ap, p);
+	while ((str = va_arg(ap, const char *))) {
+		len += strlen(str);
+	}
+	va_end(ap);
+
+	res = track = palloc(p, len + 1);
+	va_start(ap, p);
+	while ((str = va_arg(ap, const char *))) {
+		len = strlen(str);
+		memcpy(track, str, len);
+		track += len;
+	}
+	va_end(ap);
+	*track = 0;
+	return res;
+}
+
+pool *
+make_sub_pool(pool *p)
+{
+	return (pool *) arena;
+}
+
+void
+destroy_pool(pool *p)
+{
+}
+
+array_header *
+make_array(pool *p, unsigned int nelts, size_t elt_size)
+{
+	array_header *array = pcalloc(p, sizeof(array_header));
+
+	array->pool = p;
+	array->elt_size = elt_size;
+	array->nalloc = nelts ? nelts : 1;
+	array->elts = pcalloc(p, array->nalloc * elt_size);
+	return array;
+}
+
+void *
+push_array(array_header *array)
+{
+	void *elts;
+
+	if (array->nelts == array->nalloc) {
+		elts = pcalloc(array->pool, 2 * array->nalloc * array->elt_size);
+		memcpy(elts, array->elts, array->nalloc * array->elt_size);
+		array->elts = elts;
+		array->nalloc *= 2;
+	}
+	return (char *) array->elts + array->elt_size * array->nelts++;
+}
+
+void
+pr_log_pri(int priority, const char *fmt, ...)
+{
+}
+
+/* The module as it was first written, for comparison. */
+static char *
+baseline_urlencode(pool *p, const char *str)
+{
+	char *escaped, *check, *track;
+	unsigned int num_to_escape;
+
+	num_to_escape = 0;
+	check = (char *) str;
+	while (*check) {
+		if (! (isalnum(*check) || *check == '-' || *check == '_' ||
+		       *check == '.' || *check == ' ')) {
+
+			++num_to_escape;
+		}
+		++check;
+	}
+
+	escaped = pcalloc(p, strlen(str) + (2 * num_to_escape) + 1);
+
+	check = (char *) str;
+	track = (char *) escaped;
+	while (*check) {
+		if (isalnum(*check) || *check == '-' || *check == '_' || *check == '.') {
+			*track = *check;
+		} else if (*check == ' ') {
+			*track = '+';
+		} else {
+			char in_hex[3];
+			snprintf(in_hex, 3, "%02x", *check);
+			*track++ = '%';
+			*track++ = in_hex[0];
+			*track   = in_hex[1];
+		}
+		++track;
+		++check;
+	}
+	*track = 0;
+
+	return escaped;
+}
+
+static char *baseline_data;
+
+static size_t
+baseline_response_data(const char *buffer, size_t len)
+{
+	char *str = pstrndup(NULL, buffer, len);
+
+	baseline_data = pstrcat(NULL, baseline_data ? baseline_data : "", str, NULL);
+	return len;
+}
+
+static size_t
+baseline_response_headers(const char *buffer, size_t len)
+{
+	char *str;
+
+	if (buffer[len - 1] == '\r' || buffer[len - 1] == '\n') {
+		--len;
+	}
+	if (buffer[len - 1] == '\r' || buffer[len - 1] == '\n') {
+		--len;
+	}
+	str = pstrndup(NULL, buffer, len);
+	if (received_headers == NULL) {
+		received_headers = make_array(NULL, 16, sizeof(char *));
+	}
+	*((char **) push_array(received_headers)) = str;
+	return len;
+}
+
+static int64_t
+bench_now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Keeps results alive, so the compiler can't drop the work. */
+static volatile size_t sink;
+
+static void
+bench_report(const char *name, int64_t nsec, unsigned long iterations,
+             size_t bytes)
+{
+	double per_op = (double) nsec / iterations;
+
+	printf("%-44s %10.1f ns/op", name, per_op);
+	if (bytes > 0) {
+		printf(" %9.1f MB/s", bytes * 1000.0 / per_op);
+	}
+	printf("\n");
+}
+
+#define BENCH(name, iterations, bytes, body) do { \
+	unsigned long bench_i; \
+	int64_t bench_start = bench_now_nsec(); \
+	for (bench_i = 0; bench_i < (iterations); ++bench_i) { \
+		arena_reset(); \
+		body; \
+	} \
+	bench_report((name), bench_now_nsec() - bench_start, (iterations), (bytes)); \
+} while (0)
+
+static int
+bench_ascii(const char *str)
+{
+	for (; *str; ++str) {
+		if ((unsigned char) *str >= 0x80) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void
+bench_urlencode(unsigned long iterations)
+{
+	static const struct {
+		const char *name, *value;
+	} inputs[] = {
+		{ "64-byte token",
+		  "dGhpcyBpcyBhIHRva2VuLXN0eWxlIHBhc3N3b3JkIGZvci1iZW5jaG1hcmtpbmcu" },
+		{ "16-byte password",
+		  "hunter2-hunter22" },
+		{ "e-mail address",
+		  "someone.with.a.long.name@example.com" },
+		{ "UTF-8 passphrase",
+		  "c\xc3\xb4t\xc3\xa9 ouest, \xc3\xa0 l'\xc3\xa9t\xc3\xa9 pr\xc3\xa9""f\xc3\xa9r\xc3\xa9" },
+	};
+	char name[64], dst[1024];
+	size_t len;
+	register unsigned int i;
+
+	for (i = 0; i < sizeof(inputs) / sizeof(inputs[0]); ++i) {
+		len = strlen(inputs[i].value);
+
+		/* The baseline mis-encodes high-bit bytes, so compare only ASCII. */
+		dst[auth_web_urlencode(dst, inputs[i].value, len)] = 0;
+		if (bench_ascii(inputs[i].value) &&
+		    strcmp(dst, baseline_urlencode(NULL, inputs[i].value)) != 0) {
+			fprintf(stderr, "urlencode of %s differs from baseline: %s\n", inputs[i].name, dst);
+			exit(1);
+		}
+
+		snprintf(name, sizeof(name), "urlencode baseline, %s", inputs[i].name);
+		BENCH(name, iterations, len,
+			sink += strlen(baseline_urlencode(NULL, inputs[i].value)));
+
+		snprintf(name, sizeof(name), "urlencode, %s", inputs[i].name);
+		BENCH(name, iterations, len,
+			sink += auth_web_urlencode(dst, inputs[i].value, len));
+	}
+}
+
+/* Feeds a body of size bytes, in chunks as libcurl would deliver them,
+ * that doesn't contain the failed string, so all of it is examined.
+ */
+static void
+bench_body(unsigned long iterations, size_t size)
+{
+	static const char failed[] = "Invalid username or password";
+	static char body[1024 * 1024];
+	size_t chunk = 16384, off, n;
+	char name[64];
+	register size_t i;
+
+	for (i = 0; i < size; ++i) {
+		body[i] = "abcdefghijklmnopqrstuvwxyz <>/=\"\n"[i % 33];
+	}
+
+	conf->failed_string = (char *) failed;
+	conf->failed_string_len = strlen(failed);
+	conf->failed_string_next = auth_web_kmp_table(NULL, failed, strlen(failed));
+	iterations = iterations * 64 / size + 1;
+
+	snprintf(name, sizeof(name), "body match baseline, %zu bytes", size);
+	BENCH(name, iterations, size, {
+		baseline_data = NULL;
+		for (off = 0; off < size; off += n) {
+			n = size - off < chunk ? size - off : chunk;
+			baseline_response_data(body + off, n);
+		}
+		sink += strstr(baseline_data, failed) != NULL;
+	});
+
+	snprintf(name, sizeof(name), "body match, %zu bytes", size);
+	BENCH(name, iterations, size, {
+		failed_string_matched = 0;
+		failed_string_found = 0;
+		for (off = 0; off < size; off += n) {
+			n = size - off < chunk ? size - off : chunk;
+			get_response_data(body + off, 1, n, NULL);
+		}
+		sink += failed_string_found;
+	});
+
+	conf->failed_string = NULL;
+}
+
+/* A typical response header block, with the required header near its
+ * end.
+ */
+static void
+bench_headers(unsigned long iterations)
+{
+	static const char *headers[] = {
+		"HTTP/1.1 200 OK\r\n",
+		"Date: Wed, 14 Oct 2026 12:00:00 GMT\r\n",
+		"Server: Apache\r\n",
+		"Cache-Control: no-store, no-cache, must-revalidate\r\n",
+		"Pragma: no-cache\r\n",
+		"Expires: Thu, 19 Nov 1981 08:52:00 GMT\r\n",
+		"Set-Cookie: session=0123456789abcdef0123456789abcdef; path=/; HttpOnly\r\n",
+		"X-Frame-Options: SAMEORIGIN\r\n",
+		"Vary: Accept-Encoding\r\n",
+		"Content-Type: text/html; charset=UTF-8\r\n",
+		"X-Login: ok\r\n",
+		"Content-Length: 1024\r\n",
+		"\r\n",
+	};
+	static char *required[] = { "X-Login: ok" };
+	static array_header required_array;
+	unsigned int nheaders = sizeof(headers) / sizeof(headers[0]);
+	size_t lens[sizeof(headers) / sizeof(headers[0])], bytes = 0;
+	register unsigned int i, j;
+
+	for (i = 0; i < nheaders; ++i) {
+		lens[i] = strlen(headers[i]);
+		bytes += lens[i];
+	}
+	required_array.elts = required;
+	required_array.nelts = 1;
+	required_array.elt_size = sizeof(char *);
+	conf->required_headers = &required_array;
+	required_matched = calloc(1, 1);
+
+	BENCH("header match baseline", iterations, bytes, {
+		received_headers = NULL;
+		for (i = 0; i < nheaders; ++i) {
+			baseline_response_headers(headers[i], lens[i]);
+		}
+		for (i = 0; i < required_array.nelts; ++i) {
+			for (j = 0; j < (unsigned int) received_headers->nelts; ++j) {
+				if (strcmp(required[i], ((char **) received_headers->elts)[j]) == 0) {
+					++sink;
+					break;
+				}
+			}
+		}
+	});
+
+	conf->early_abort = TRUE;
+	BENCH("header match, AuthWebEarlyAbort", iterations, bytes, {
+		received_headers = NULL;
+		response_decided = 0;
+		for (i = 0; i < nheaders && !response_decided; ++i) {
+			get_response_headers(headers[i], 1, lens[i], NULL);
+		}
+		sink += response_decided;
+	});
+
+	conf->required_headers = NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+
+	conf = calloc(1, sizeof(*conf));
+
+	printf("mod_auth_web micro-benchmarks, %lu iterations"
+#if defined(AUTH_WEB_NO_SIMD)
+		", without SIMD"
+#endif
+		"\n\n", iterations);
+	bench_urlencode(iterations);
+	printf("\n");
+	bench_body(iterations, 4096);
+	bench_body(iterations, 65536);
+	bench_body(iterations, 1024 * 1024);
+	printf("\n");
+	bench_headers(iterations);
+	return 0;
+}
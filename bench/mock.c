@@ -0,0 +1,314 @@
+/*
+ * A mock AuthWebURL login service, for load testing mod_auth_web.
+ *
+ * Every request gets a 200 response after the configured latency. A login
+ * succeeds if its request contains the configured password parameter; the
+ * response then carries the configured headers. Otherwise the body ends
+ * with the failure text. Connections are kept alive, and each is served
+ * by its own thread; with -c and -k, over TLS.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#define MOCK_MAX_HEADERS   64
+#define MOCK_REQUEST_MAX   65536
+
+static int port = 8080;
+static long latency_ms, jitter_ms;
+static size_t body_size = 64;
+static const char *success_match = "password=secret";
+static const char *failure_text = "Invalid username or password";
+static const char *headers[MOCK_MAX_HEADERS];
+static unsigned int nheaders;
+static SSL_CTX *ssl_ctx;
+static char *padding;
+
+struct mock_conn {
+	int fd;
+	SSL *ssl;
+};
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-p port] [-l latency-ms] [-j jitter-ms] [-b body-bytes]\n"
+		"       [-m success-match] [-f failure-text] [-H 'Name: value']...\n"
+		"       [-c cert.pem -k key.pem]\n", prog);
+	exit(2);
+}
+
+static ssize_t
+mock_read(struct mock_conn *conn, char *buf, size_t len)
+{
+	if (conn->ssl) {
+		int n = SSL_read(conn->ssl, buf, len);
+
+		return n > 0 ? n : -1;
+	}
+	return read(conn->fd, buf, len);
+}
+
+static int
+mock_write(struct mock_conn *conn, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = conn->ssl ? SSL_write(conn->ssl, buf, len) : write(conn->fd, buf, len);
+		if (n <= 0) {
+			if (!conn->ssl && n < 0 && errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void
+mock_sleep(void)
+{
+	struct timespec ts;
+	long ms = latency_ms;
+
+	if (jitter_ms > 0) {
+		ms += random() % (2 * jitter_ms + 1) - jitter_ms;
+	}
+	if (ms <= 0) {
+		return;
+	}
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+	}
+}
+
+/* Returns the length of the request at the start of buf, including its
+ * body, or 0 if it isn't complete yet.
+ */
+static size_t
+mock_request_len(const char *buf, size_t len)
+{
+	const char *end, *cl;
+	size_t header_len;
+
+	end = memmem(buf, len, "\r\n\r\n", 4);
+	if (!end) {
+		return 0;
+	}
+	header_len = end + 4 - buf;
+
+	for (cl = buf; (cl = memmem(cl, header_len - (cl - buf), "\r\n", 2)); ) {
+		cl += 2;
+		if (strncasecmp(cl, "Content-Length:", 15) == 0) {
+			size_t body_len = strtoul(cl + 15, NULL, 10);
+
+			return header_len + body_len <= len ? header_len + body_len : 0;
+		}
+	}
+	return header_len;
+}
+
+static int
+mock_respond(struct mock_conn *conn, const char *request, size_t len)
+{
+	char head[8192];
+	size_t head_len, tail_len;
+	int ok, n;
+	register unsigned int i;
+
+	ok = memmem(request, len, success_match, strlen(success_match)) != NULL;
+	tail_len = ok ? 0 : strlen(failure_text);
+
+	head_len = snprintf(head, sizeof(head),
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/html\r\n"
+		"Content-Length: %zu\r\n", body_size + tail_len);
+	for (i = 0; ok && i < nheaders; ++i) {
+		n = snprintf(head + head_len, sizeof(head) - head_len, "%s\r\n", headers[i]);
+		if (n < 0 || (size_t) n >= sizeof(head) - head_len) {
+			return -1;
+		}
+		head_len += n;
+	}
+	if (head_len + 2 >= sizeof(head)) {
+		return -1;
+	}
+	memcpy(head + head_len, "\r\n", 2);
+	head_len += 2;
+
+	mock_sleep();
+
+	/* The failure text comes last, so that clients must read the whole
+	 * body to find it.
+	 */
+	if (mock_write(conn, head, head_len) < 0 ||
+	    mock_write(conn, padding, body_size) < 0 ||
+	    (tail_len > 0 && mock_write(conn, failure_text, tail_len) < 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+static void *
+mock_serve(void *arg)
+{
+	struct mock_conn *conn = arg;
+	char *buf;
+	size_t used = 0, req_len;
+	ssize_t n;
+
+	buf = malloc(MOCK_REQUEST_MAX);
+	if (!buf) {
+		goto done;
+	}
+	if (ssl_ctx) {
+		conn->ssl = SSL_new(ssl_ctx);
+		if (!conn->ssl || SSL_set_fd(conn->ssl, conn->fd) != 1 ||
+		    SSL_accept(conn->ssl) != 1) {
+			goto done;
+		}
+	}
+
+	for (;;) {
+		while ((req_len = mock_request_len(buf, used)) == 0) {
+			if (used == MOCK_REQUEST_MAX) {
+				goto done;
+			}
+			n = mock_read(conn, buf + used, MOCK_REQUEST_MAX - used);
+			if (n <= 0) {
+				goto done;
+			}
+			used += n;
+		}
+		if (mock_respond(conn, buf, req_len) < 0) {
+			break;
+		}
+		memmove(buf, buf + req_len, used - req_len);
+		used -= req_len;
+	}
+
+done:
+	if (conn->ssl) {
+		SSL_free(conn->ssl);
+	}
+	close(conn->fd);
+	free(buf);
+	free(conn);
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in addr;
+	struct mock_conn *conn;
+	pthread_attr_t attr;
+	pthread_t thread;
+	const char *cert = NULL, *key = NULL;
+	int opt, fd, on = 1;
+
+	while ((opt = getopt(argc, argv, "p:l:j:b:m:f:H:c:k:")) != -1) {
+		switch (opt) {
+		case 'p': port = atoi(optarg); break;
+		case 'l': latency_ms = atol(optarg); break;
+		case 'j': jitter_ms = atol(optarg); break;
+		case 'b': body_size = strtoul(optarg, NULL, 10); break;
+		case 'm': success_match = optarg; break;
+		case 'f': failure_text = optarg; break;
+		case 'H':
+			if (nheaders == MOCK_MAX_HEADERS) {
+				usage(argv[0]);
+			}
+			headers[nheaders++] = optarg;
+			break;
+		case 'c': cert = optarg; break;
+		case 'k': key = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (!cert != !key) {
+		usage(argv[0]);
+	}
+
+	padding = malloc(body_size ? body_size : 1);
+	if (!padding) {
+		perror("malloc");
+		return 1;
+	}
+	memset(padding, 'x', body_size);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (cert) {
+		ssl_ctx = SSL_CTX_new(TLS_server_method());
+		if (!ssl_ctx ||
+		    SSL_CTX_use_certificate_chain_file(ssl_ctx, cert) != 1 ||
+		    SSL_CTX_use_PrivateKey_file(ssl_ctx, key, SSL_FILETYPE_PEM) != 1) {
+			ERR_print_errors_fp(stderr);
+			return 1;
+		}
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return 1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	    listen(fd, 1024) < 0) {
+		perror("bind");
+		return 1;
+	}
+	fprintf(stderr, "listening on %s://127.0.0.1:%d/\n", ssl_ctx ? "https" : "http", port);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, 256 * 1024);
+
+	for (;;) {
+		int client = accept(fd, NULL, NULL);
+
+		if (client < 0) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				perror("accept");
+			}
+			continue;
+		}
+		setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		conn = calloc(1, sizeof(*conn));
+		if (!conn) {
+			close(client);
+			continue;
+		}
+		conn->fd = client;
+		if (pthread_create(&thread, &attr, mock_serve, conn) != 0) {
+			close(client);
+			free(conn);
+		}
+	}
+	return 0;
+}
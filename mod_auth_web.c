@@ -23,307 +23,6708 @@
 #include "conf.h"
 #include "privs.h"
 
+#include <grp.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#ifdef __linux__
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
+#ifdef HAVE_CRYPT_H
+# include <crypt.h>
+#endif
+#ifdef PR_USE_OPENSSL
+# include <openssl/evp.h>
+# include <openssl/hmac.h>
+# include <openssl/rand.h>
+#endif
+/* Define AUTH_WEB_NO_SIMD to build only the portable code paths. */
+#if !defined(AUTH_WEB_NO_SIMD) && defined(__SSE2__)
+# define AUTH_WEB_SSE2
+# include <emmintrin.h>
+#elif !defined(AUTH_WEB_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+# define AUTH_WEB_NEON
+# include <arm_neon.h>
+#endif
+
 #define MOD_AUTH_WEB_VERSION  "mod_auth_web/1.1.2"
 
-/* Config values */
-static char *local_user;
-static char *url, *user_param_name, *pass_param_name;
-static char *failed_string;
-static array_header *required_headers, *received_headers;
+#define AUTH_WEB_CACHE_DEFAULT_SIZE  1024
+#define AUTH_WEB_CACHE_USER_LEN      128
+#define AUTH_WEB_CACHE_HASH_LEN      128
+#define AUTH_WEB_CACHE_SALT_LEN      16
+#define AUTH_WEB_CACHE_HASH_ROUNDS   "5000"
+#define AUTH_WEB_CACHE_PROBES        8
+#define AUTH_WEB_CACHE_EVICT_LRU     0
+#define AUTH_WEB_CACHE_EVICT_FIFO    1
+#define AUTH_WEB_CACHE_MISS          0
+#define AUTH_WEB_CACHE_HIT           1
+#define AUTH_WEB_CACHE_STALE         2
+#define AUTH_WEB_LOCK_SPINS          100000
+
+#define AUTH_WEB_COOKIE_LEN          1024
+#define AUTH_WEB_COOKIE_KEY_LEN      32
+#define AUTH_WEB_COOKIE_IV_LEN       12
+#define AUTH_WEB_COOKIE_TAG_LEN      16
+#define AUTH_WEB_COOKIE_DEFAULT_TTL  3600
+
+#define AUTH_WEB_OFFLINE_MAGIC       "AWOFF1\n"
+#define AUTH_WEB_OFFLINE_TABLE       64
+#define AUTH_WEB_OFFLINE_HASH_ROUNDS "50000"
+#define AUTH_WEB_OFFLINE_DEFAULT_TTL 86400
+
+#define AUTH_WEB_FLIGHT_SLOTS        64
+#define AUTH_WEB_FLIGHT_PROBES       8
+#define AUTH_WEB_FLIGHT_FREE         0
+#define AUTH_WEB_FLIGHT_BUSY         1
+#define AUTH_WEB_FLIGHT_DONE         2
+
+/* Outcomes of a login request */
+#define AUTH_WEB_LOGIN_OK            0
+#define AUTH_WEB_LOGIN_REJECTED      1
+#define AUTH_WEB_LOGIN_DECLINED      2
+#define AUTH_WEB_LOGIN_UNAVAILABLE   3
+
+#define AUTH_WEB_BROKER_DEFAULT_CONNS  16
+
+/* Extra time the daemon waits for warm-up requests beyond their timeout */
+#define AUTH_WEB_WARM_UP_GRACE         5
+
+/* Processes verifying logins for "ftpdctl authweb warm" */
+#define AUTH_WEB_WARM_DEFAULT_WORKERS  8
+#define AUTH_WEB_WARM_MAX_WORKERS      256
+#define AUTH_WEB_WARM_MAX_LINE         1024
+#define AUTH_WEB_BROKER_MAX_PENDING    256
+#define AUTH_WEB_BROKER_MAX_REQUEST    65536
+#define AUTH_WEB_BROKER_MAX_QUEUE      262144
+#define AUTH_WEB_BROKER_MAX_HEADER     CURL_MAX_HTTP_HEADER
+
+#define AUTH_WEB_TLS_SESSIONS        32
+#define AUTH_WEB_TLS_KEY_LEN         256
+#define AUTH_WEB_TLS_HMAC_LEN        64
+#define AUTH_WEB_TLS_DATA_LEN        4096
+
+/* Broker frame types */
+#define AUTH_WEB_FRAME_URL         1
+#define AUTH_WEB_FRAME_POSTFIELDS  2
+#define AUTH_WEB_FRAME_HEADER      3
+#define AUTH_WEB_FRAME_DATA        4
+#define AUTH_WEB_FRAME_DONE        5
+#define AUTH_WEB_FRAME_OPTIONS     6
+#define AUTH_WEB_FRAME_TIMINGS     7
+
+/* AuthWebHTTPVersion values */
+#define AUTH_WEB_HTTP_DEFAULT      0
+#define AUTH_WEB_HTTP_1_0          1
+#define AUTH_WEB_HTTP_1_1          2
+#define AUTH_WEB_HTTP_2            3
+
+/* AuthWebMethod and AuthWebBodyFormat values */
+#define AUTH_WEB_METHOD_POST       0
+#define AUTH_WEB_METHOD_GET        1
+#define AUTH_WEB_BODY_FORM         0
+#define AUTH_WEB_BODY_JSON         1
+#define AUTH_WEB_BODY_NONE         2
+
+/* AuthWebExtraHeader slots */
+#define AUTH_WEB_SLOT_NONE         0
+#define AUTH_WEB_SLOT_USER         1
+#define AUTH_WEB_SLOT_PASS         2
+#define AUTH_WEB_SLOT_BASIC        3
+
+#define AUTH_WEB_BROKER_DEFAULT_STREAMS   100
+
+#define AUTH_WEB_DEFAULT_MAX_RESPONSE     (1024 * 1024)
+#define AUTH_WEB_DEFAULT_MAX_HEADERS      100
+
+#define AUTH_WEB_DEFAULT_CONNECT_TIMEOUT  10
+#define AUTH_WEB_DEFAULT_TIMEOUT          30
+#define AUTH_WEB_DEFAULT_BACKEND_RETRY    10
+
+#define AUTH_WEB_BACKEND_URL_LEN     256
+#define AUTH_WEB_BACKEND_MAX_SLOTS   256
+#define AUTH_WEB_DEFAULT_QUEUE_TIMEOUT  5
+
+/* Request phases timed for each backend */
+#define AUTH_WEB_PHASE_DNS           0
+#define AUTH_WEB_PHASE_CONNECT       1
+#define AUTH_WEB_PHASE_TLS           2
+#define AUTH_WEB_PHASE_TTFB          3
+#define AUTH_WEB_PHASE_TOTAL         4
+#define AUTH_WEB_PHASES              5
+
+/* Latency histograms: exact below 2^AUTH_WEB_HIST_SUB_BITS + 1
+ * microseconds, then 2^AUTH_WEB_HIST_SUB_BITS buckets per power of two up
+ * to 2^31.
+ */
+#define AUTH_WEB_HIST_SUB_BITS       5
+/* CURLcode values above this are counted together */
+#define AUTH_WEB_CURL_CODES          128
+
+#define AUTH_WEB_DEFAULT_METRICS_INTERVAL 15
+
+#define AUTH_WEB_HIST_BUCKETS        ((2 << AUTH_WEB_HIST_SUB_BITS) + \
+	(30 - AUTH_WEB_HIST_SUB_BITS) * (1 << AUTH_WEB_HIST_SUB_BITS))
+
+#define AUTH_WEB_BREAKER_CLOSED      0
+#define AUTH_WEB_BREAKER_OPEN        1
+
+/* AuthWebRule subjects, operators, and per-attempt states */
+#define AUTH_WEB_RULE_STATUS         1
+#define AUTH_WEB_RULE_HEADER         2
+#define AUTH_WEB_RULE_JSON           3
+#define AUTH_WEB_RULE_OP_EQ          1
+#define AUTH_WEB_RULE_OP_MATCH       2
+#define AUTH_WEB_RULE_UNKNOWN        0
+#define AUTH_WEB_RULE_PASS           1
+#define AUTH_WEB_RULE_FAIL           2
+#define AUTH_WEB_RULE_BODY_MAX       65536
+
+/* AuthWebUserRegex matchers */
+#define AUTH_WEB_MATCH_REGEX         0
+#define AUTH_WEB_MATCH_EXACT         1
+#define AUTH_WEB_MATCH_PREFIX        2
+#define AUTH_WEB_MATCH_SUFFIX        3
+#define AUTH_WEB_MATCH_CONTAINS      4
+
+/* Most AuthWebUserRegex patterns are literals, perhaps anchored, such as
+ * "@example\.com$". set_user_regex() recognizes these and compiles them to
+ * a plain comparison; '.' is allowed, and compared as a wildcard in any.
+ * Anything else is left to the regex engine.
+ */
+struct auth_web_user_match {
+	int kind;
+	char *literal;
+	size_t len;
+	unsigned char *any;
+	pr_regex_t *creg;
+};
+
+/* AuthWebUserSuffix values, lowercased, in an open-addressed hash set. A
+ * username is looked up once for each distinct suffix length.
+ */
+struct auth_web_suffixes {
+	unsigned int mask;
+	char **slots;
+	size_t *lens;
+	unsigned int nlens;
+};
+
+/* Config values are resolved for every server once the configuration has
+ * been read, so a session only has to find its server's entry in
+ * auth_web_confs. Servers lacking the directives needed to authenticate,
+ * and with no AuthWebRouteFile, get no entry.
+ *
+ * With an AuthWebRouteFile, each tenant has a configuration of its own,
+ * and each login picks one from server_conf->routes; conf always points to
+ * the configuration of the login in progress.
+ *
+ * body_prefix, body_infix and body_suffix are the fixed parts of the
+ * request body, already encoded: "user_param_name=", "&pass_param_name="
+ * and "" for forms, or the corresponding JSON punctuation. With
+ * AuthWebMethod GET, the form is sent as the URL's query string instead.
+ *
+ * headers starts with the AuthWebExtraHeader nodes that have credential
+ * slots, whose data is filled in for each login, followed by
+ * static_headers, which never carry credentials.
+ */
+struct auth_web_tmpl_part {
+	const char *text;
+	size_t len;
+	int slot;
+};
+
+struct auth_web_tmpl {
+	struct auth_web_tmpl_part *parts;
+	unsigned int nparts, nslots;
+	size_t fixed_len;
+	struct curl_slist *node;
+};
+
+struct auth_web_route_node {
+	unsigned int child, sibling;
+	int tenant, exact;
+	unsigned char ch;
+};
+
+struct auth_web_routes {
+	array_header *prefix, *suffix, *tenants;
+};
+
+struct auth_web_conf {
+	struct auth_web_conf *next;
+	server_rec *server;
+	int enabled;
+	struct auth_web_routes *routes;
+	char *local_user;
+	char *user_param_name, *pass_param_name;
+	int method, body_format;
+	char *body_prefix, *body_infix, *body_suffix;
+	size_t body_prefix_len, body_infix_len, body_suffix_len, max_url_len;
+	array_header *extra_headers, *header_tmpls;
+	char *failed_string;
+	size_t failed_string_len, *failed_string_next;
+	array_header *required_headers, *urls, *rules;
+	struct curl_slist *headers, *static_headers;
+	struct auth_web_user_match *user_match;
+	struct auth_web_suffixes *user_suffixes;
+	int cache_ttl, neg_cache_ttl;
+	int connect_timeout, total_timeout, low_speed_timeout;
+	int backend_retry, breaker_failures, breaker_cooldown;
+	int early_abort, rules_need_body;
+	int coalesce, cache_soft_ttl;
+	int max_concurrent, rate_limit, rate_burst, queue_timeout;
+	int http_version;
+	char *validate_url;
+	int cookie_ttl;
+	int max_response_bytes, max_headers;
+};
+
+static pool *auth_web_conf_pool;
+static struct auth_web_conf *auth_web_confs, *server_conf, *conf;
+static struct curl_slist *auth_web_headers;
+
+/* Response headers are kept in response_pool, which only lives for one
+ * login; response_bytes and nresponse_headers count what the current
+ * response has sent against AuthWebMaxResponseBytes and AuthWebMaxHeaders.
+ * response_too_large is set once it goes over either; the login is then
+ * declined, though the URL did answer.
+ */
+static pool *response_pool;
+static array_header *received_headers;
+static size_t response_bytes;
+static unsigned int nresponse_headers;
+static int response_too_large;
+
+static char *body_buf, *header_buf;
+static size_t body_buf_size, body_len, header_buf_size, header_len;
+
+/* Every distinct AuthWebURL is a backend. The daemon registers them all in
+ * shared memory, so that every session process sees the same latency and
+ * error history when choosing where to send a login. Statistics are updated
+ * without locking; an occasional lost update is harmless.
+ *
+ * Each backend also has a circuit breaker. After breaker_failures
+ * consecutive failures it opens, and logins skip the backend entirely for
+ * breaker_cooldown seconds. After that, the first session to claim probe
+ * sends a single request; its result closes or re-opens the breaker.
+ *
+ * AuthWebMaxConcurrent and AuthWebRateLimit are enforced per backend, too.
+ * A request in flight holds one of the first AuthWebMaxConcurrent entries
+ * of slots, recording its pid so that slots held by sessions that died
+ * can be reclaimed; released is bumped, and waiters woken, whenever one is
+ * freed. The rate limit is a token bucket, counted in thousandths of a
+ * token and refilled according to the monotonic clock, under lock.
+ */
+struct auth_web_backend {
+	unsigned long key;
+	volatile long latency;
+	volatile long errors;
+	volatile time_t down_until;
+	volatile int state;
+	volatile unsigned int failures;
+	volatile time_t opened;
+	volatile pid_t probe;
+	volatile pid_t lock;
+	volatile int released;
+	int64_t tokens, refilled;
+	volatile pid_t slots[AUTH_WEB_BACKEND_MAX_SLOTS];
+	char url[AUTH_WEB_BACKEND_URL_LEN];
+};
+
+struct auth_web_url {
+	char *url;
+	struct auth_web_backend *backend;
+};
+
+/* Latency statistics live in one more shared mapping, sized for the
+ * backend registry: a histogram per request phase for each backend, plus
+ * histograms of cache lookup and rule evaluation times. Sessions update
+ * them with atomic increments, so recording never takes a lock; the
+ * histogram buckets are log-linear, as in HdrHistogram, giving about 3%
+ * precision at any scale.
+ */
+struct auth_web_hist {
+	uint32_t count[AUTH_WEB_HIST_BUCKETS];
+};
+
+struct auth_web_backend_stats {
+	struct auth_web_hist phase[AUTH_WEB_PHASES];
+	uint64_t requests, reused, bytes;
+};
+
+struct auth_web_stats {
+	size_t len;
+	uint64_t attempts, successes, rejections, declines, coalesced,
+		breaker_trips, offline_logins, curl_errors[AUTH_WEB_CURL_CODES];
+	struct auth_web_hist cache_lookup, rules;
+	struct auth_web_backend_stats backends[];
+};
+
+#define AUTH_WEB_COUNT(counter) \
+	do { if (stats) __sync_fetch_and_add(&stats->counter, 1); } while (0)
+
+/* What libcurl reports about one request, in microseconds and bytes. */
+struct auth_web_timings {
+	int64_t phase[AUTH_WEB_PHASES];
+	int64_t bytes;
+	int32_t reused;
+};
+
+static struct auth_web_stats *stats;
+static struct auth_web_timings timings;
+static int timings_valid;
+static int64_t rules_usec;
+
+static struct auth_web_backend *backends;
+static unsigned int nbackends;
+static size_t backends_len;
+static unsigned int backend_seed;
+
+/* The response body is never kept. It is scanned for failed_string as it
+ * arrives, using Knuth-Morris-Pratt so matches spanning chunks are found;
+ * failed_string_next is the KMP failure table and failed_string_matched the
+ * length of the partial match carried over from the previous chunk.
+ *
+ * response_decided is set when a callback stops the transfer because the
+ * verdict is already known, so the resulting write error isn't treated as
+ * a failed request.
+ */
+static size_t failed_string_len, failed_string_matched, *failed_string_next;
+static int failed_string_found, response_decided;
+
+/* With AuthWebEarlyAbort, required headers are ticked off in
+ * required_matched as they arrive, so the transfer can stop as soon as the
+ * verdict is known rather than after the body has been read.
+ */
+static int interim_response;
+static unsigned char *required_matched;
+static unsigned int nrequired_matched;
+
+/* AuthWebRule directives are compiled when the configuration is read and
+ * gathered into a flat array per server. Each rule is decided as
+ * soon as its subject arrives (the status line, a header, or the end of
+ * the header block), so a failing rule stops the transfer. JSON rules need
+ * the body, which is kept for them in rule_body, up to
+ * AUTH_WEB_RULE_BODY_MAX bytes.
+ *
+ * Negated operators are compiled into their positive form with deny
+ * flipped, so "status != 200" is stored as deny "status = 200".
+ */
+struct auth_web_rule {
+	char *text;
+	int subject, op, deny;
+	char *name;
+	size_t name_len;
+	char *value;
+	long status;
+	pr_regex_t *creg;
+};
+
+static unsigned char *rule_states;
+static int response_status;
+static char *rule_body;
+static size_t rule_body_len;
+
+/* Successful logins are remembered in an anonymous shared mapping created
+ * by the daemon before it forks, so every session process sees the same
+ * cache. Passwords are never stored; entries hold a salted crypt(3) hash.
+ *
+ * The table is open-addressed: a login hashes to a bucket and may live in
+ * any of the AUTH_WEB_CACHE_PROBES buckets following it. Each bucket has
+ * its own lock, so sessions only contend when they touch the same bucket.
+ *
+ * With AuthWebCacheSoftTTL, a hit on an entry older than the soft TTL is
+ * still served, but the first session to see it also claims refreshing
+ * and forks a helper that revalidates the login in the background, so
+ * that busy accounts never wait on AuthWebURL when their entry expires.
+ *
+ * Failed logins are kept in a second table of the same shape, keyed on
+ * username and client address instead of password hash, so that a flood
+ * of bad logins can't evict successful ones. In that table (by_hash) the
+ * address is part of the key, so each address a user fails from gets its
+ * own entry.
+ */
+struct auth_web_cache_entry {
+	volatile pid_t lock;
+	unsigned int sid;
+	unsigned long key;
+	time_t stored, used, expires;
+	volatile pid_t refreshing;
+	char user[AUTH_WEB_CACHE_USER_LEN];
+	char hash[AUTH_WEB_CACHE_HASH_LEN];
+};
+
+struct auth_web_cache {
+	const char *name;
+	size_t len;
+	unsigned int size, probes;
+	int eviction, by_hash;
+	unsigned long hits, misses, stores, evictions;
+	char salt[AUTH_WEB_CACHE_SALT_LEN + 1];
+	struct auth_web_cache_entry entries[];
+};
+
+static struct auth_web_cache *cache, *neg_cache;
+
+/* With AuthWebOfflineFile, the password each user last logged in with is
+ * also kept, as a slower crypt(3) hash, in a table of the same shape
+ * mapped from a file, so that it survives restarts. When no AuthWebURL
+ * gives an answer, a user who logged in within the file's TTL is verified
+ * against it instead of being declined.
+ *
+ * The table starts AUTH_WEB_OFFLINE_TABLE bytes into the file, after a
+ * header recording its length and the server layout its entries' server
+ * IDs refer to. A file written for another layout, size or build is
+ * replaced, by renaming, so sessions still using the old one are safe.
+ *
+ * offline_prints, an anonymous table like the credential cache and
+ * sharing its salt, holds the cheap hash of the password each offline
+ * entry was written for. It never reaches the file, and lets a login tell
+ * whether its password is the one on file without running the slow hash.
+ */
+struct auth_web_offline_header {
+	char magic[8];
+	unsigned long layout;
+	size_t len;
+};
+
+static struct auth_web_cache *offline, *offline_prints;
+static void *offline_map;
+static size_t offline_map_len;
+static int offline_ttl, offline_opened;
+
+/* With AuthWebValidateURL, the session cookies set by a successful login
+ * are kept alongside its cache entry, in a table of the same size, so
+ * that once the entry expires the login can be confirmed with a GET
+ * carrying the cookies instead of posting the password again. A cookie
+ * slot belongs to the cache entry with the same index and is protected by
+ * its lock.
+ *
+ * Cookies are encrypted with AES-256-GCM under a key derived from the
+ * username, password, and a per-daemon secret that is not in shared
+ * memory, so they are only usable by a login that knows the password.
+ */
+struct auth_web_cookie {
+	time_t expires;
+	unsigned int len;
+	unsigned char iv[AUTH_WEB_COOKIE_IV_LEN];
+	unsigned char tag[AUTH_WEB_COOKIE_TAG_LEN];
+	unsigned char data[AUTH_WEB_COOKIE_LEN];
+};
+
+static struct auth_web_cookie *cookies;
+static size_t cookies_len;
+static unsigned char cookie_secret[AUTH_WEB_COOKIE_KEY_LEN];
+
+/* With AuthWebCoalesce, a login that misses the cache first looks for an
+ * identical login (same configuration, username, and password hash)
+ * already in flight in another session. If one is found, the session
+ * waits for that request's outcome instead of sending its own; seq is
+ * bumped, and on Linux used as a futex to wake the waiters, each time a
+ * result is published. Otherwise, the session claims a slot and becomes
+ * the leader for that login.
+ */
+struct auth_web_flight {
+	volatile int seq;
+	int state, result;
+	pid_t leader;
+	unsigned long key;
+	const void *conf;
+	char user[AUTH_WEB_CACHE_USER_LEN];
+	char hash[AUTH_WEB_CACHE_HASH_LEN];
+};
+
+struct auth_web_flights {
+	volatile pid_t lock;
+	char salt[AUTH_WEB_CACHE_SALT_LEN + 1];
+	struct auth_web_flight slots[AUTH_WEB_FLIGHT_SLOTS];
+};
+
+static struct auth_web_flights *flights;
+
+/* The broker is a helper process, forked from the daemon, that performs
+ * HTTP requests on behalf of session processes over a Unix domain socket.
+ * Because it outlives any one session, its libcurl multi handle keeps
+ * connections (and their TLS sessions) to AuthWebURL alive between logins.
+ *
+ * Requests and responses are sequences of frames: a struct auth_web_frame
+ * followed by len bytes of payload. A request is prefixed by its total
+ * length and carries URL, POSTFIELDS, and HEADER frames, each payload
+ * NUL-terminated, plus a TIMEOUTS frame of three int32_t. The broker answers with a HEADER frame per response
+ * header line and DATA frames for the body, then a DONE frame carrying
+ * the CURLcode and error message. A session that has seen enough simply
+ * closes the socket, and the broker abandons the transfer. Frames are
+ * queued and written as the socket takes them, so a session that is slow
+ * to read only pauses its own transfer.
+ */
+struct auth_web_frame {
+	uint32_t type, len;
+};
+
+struct auth_web_broker_conn {
+	struct auth_web_broker_conn *next;
+	pool *pool;
+	int fd, done, failed, paused;
+	uint32_t want, have;
+	char *buf;
+	CURL *curl;
+	struct curl_slist *headers;
+	char error[CURL_ERROR_SIZE];
+
+	/* Frames not yet taken by the session's socket */
+	char *out;
+	size_t out_off, out_len, out_size;
+};
+
+/* With AuthWebTLSSessionCache, the daemon creates a CURLSH before forking so
+ * every session's handle shares DNS, connection, and TLS session caches.
+ * Each session's copy of the share dies with it, though, so TLS sessions
+ * are also exported to a small shared-memory store that later sessions
+ * import, letting them resume rather than perform a full handshake.
+ */
+struct auth_web_tls_session {
+	volatile pid_t lock;
+	time_t stored, valid_until;
+	size_t shmac_len, sdata_len;
+	char key[AUTH_WEB_TLS_KEY_LEN];
+	unsigned char shmac[AUTH_WEB_TLS_HMAC_LEN];
+	unsigned char sdata[AUTH_WEB_TLS_DATA_LEN];
+};
+
+static CURLSH *share;
+
+/* The easy and multi handles for direct requests, kept for the life of
+ * the process that created them so that retries reuse their connections
+ * and caches.
+ */
+static CURL *easy_handle;
+static CURLM *easy_multi;
+static pid_t easy_handle_pid;
+static struct auth_web_tls_session *tls_sessions;
+static int tls_sessions_imported;
+
+static struct sockaddr_un broker_addr;
+static pid_t broker_pid;
+static int broker_ctl_fd = -1;
+
+static pid_t metrics_pid;
+static int metrics_ctl_fd = -1;
+
+module auth_web_module;
+
+static void auth_web_body_wipe(void);
+static int auth_web_user_allowed(pool *p, const char *user);
+static struct auth_web_conf *auth_web_route(const char *user);
+
+
+MODRET
+handle_auth_web_getpwnam(cmd_rec *cmd)
+{
+	struct passwd *pw;
+
+	conf = auth_web_route(cmd->argv[0]);
+	if (!conf) {
+		return PR_DECLINED(cmd);
+	}
+	if (!auth_web_user_allowed(cmd->tmp_pool, cmd->argv[0])) {
+		pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": user doesn't match AuthWebUserRegex or AuthWebUserSuffix");
+		return PR_DECLINED(cmd);
+	}
+
+	pw = pcalloc(session.pool, sizeof(struct passwd));
+	if (!pw) {
+		return PR_DECLINED(cmd);
+	}
+
+	memcpy(pw, getpwnam(conf->local_user), sizeof(struct passwd));
+	pw->pw_name = pstrdup(session.pool, cmd->argv[0]);
+	if (!pw->pw_name) {
+		return PR_DECLINED(cmd);
+	}
+	return mod_create_data(cmd, pw);
+}
+
+static const char *
+auth_web_json_ws(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+		++p;
+	}
+	return p;
+}
+
+/* Returns a pointer just past the JSON value starting at p, or NULL. */
+static const char *
+auth_web_json_skip(const char *p, const char *end)
+{
+	int depth = 0, in_string = 0;
+
+	if (p >= end) {
+		return NULL;
+	}
+	if (*p != '{' && *p != '[' && *p != '"') {
+		while (p < end && !strchr(",}] \t\r\n", *p)) {
+			++p;
+		}
+		return p;
+	}
+
+	for (; p < end; ++p) {
+		if (in_string) {
+			if (*p == '\\') {
+				++p;
+			} else if (*p == '"') {
+				in_string = 0;
+				if (depth == 0) {
+					return p + 1;
+				}
+			}
+		} else if (*p == '"') {
+			in_string = 1;
+		} else if (*p == '{' || *p == '[') {
+			++depth;
+		} else if (*p == '}' || *p == ']') {
+			if (--depth == 0) {
+				return p + 1;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Finds the value at a dotted path such as "result.ok" or "items.0.id". */
+static const char *
+auth_web_json_find(const char *p, const char *end, const char *path,
+                   const char **value_end)
+{
+	const char *seg, *seg_end, *key;
+	size_t key_len;
+	long index;
+
+	p = auth_web_json_ws(p, end);
+	for (seg = path; *seg; seg = *seg_end ? seg_end + 1 : seg_end) {
+		seg_end = strchr(seg, '.');
+		if (!seg_end) {
+			seg_end = seg + strlen(seg);
+		}
+
+		if (p < end && *p == '{') {
+			for (p = auth_web_json_ws(p + 1, end); p < end && *p == '"';) {
+				key = p + 1;
+				if (!(p = auth_web_json_skip(p, end))) {
+					return NULL;
+				}
+				key_len = p - key - 1;
+				p = auth_web_json_ws(p, end);
+				if (p >= end || *p != ':') {
+					return NULL;
+				}
+				p = auth_web_json_ws(p + 1, end);
+				if (key_len == (size_t) (seg_end - seg) &&
+				    strncmp(key, seg, key_len) == 0) {
+					break;
+				}
+				if (!(p = auth_web_json_skip(p, end))) {
+					return NULL;
+				}
+				p = auth_web_json_ws(p, end);
+				if (p < end && *p == ',') {
+					p = auth_web_json_ws(p + 1, end);
+				}
+			}
+			if (p >= end || *p == '}') {
+				return NULL;
+			}
+
+		} else if (p < end && *p == '[' && isdigit((int) *seg)) {
+			index = strtol(seg, NULL, 10);
+			for (p = auth_web_json_ws(p + 1, end); index > 0; --index) {
+				if (!(p = auth_web_json_skip(p, end))) {
+					return NULL;
+				}
+				p = auth_web_json_ws(p, end);
+				if (p >= end || *p != ',') {
+					return NULL;
+				}
+				p = auth_web_json_ws(p + 1, end);
+			}
+			if (p >= end || *p == ']') {
+				return NULL;
+			}
+
+		} else {
+			return NULL;
+		}
+	}
+
+	*value_end = auth_web_json_skip(p, end);
+	return *value_end ? p : NULL;
+}
+
+static int64_t auth_web_now_usec(void);
+
+static int
+auth_web_rule_compare(struct auth_web_rule *rule, const char *value)
+{
+	if (rule->op == AUTH_WEB_RULE_OP_MATCH) {
+		return pr_regexp_exec(rule->creg, value, 0, NULL, 0, 0, 0) == 0;
+	}
+	return strcmp(rule->value, value) == 0;
+}
+
+static int
+auth_web_rule_json(pool *p, struct auth_web_rule *rule)
+{
+	const char *value, *value_end;
+	char *str, *out;
+
+	if (!rule_body) {
+		return 0;
+	}
+	value = auth_web_json_find(rule_body, rule_body + rule_body_len,
+		rule->name, &value_end);
+	if (!value) {
+		return 0;
+	}
+
+	/* Compare strings by their contents, anything else by its text. */
+	if (*value == '"') {
+		str = out = palloc(p, value_end - value);
+		for (++value, --value_end; value < value_end; ++value) {
+			if (*value == '\\' && value + 1 < value_end) {
+				++value;
+				*out++ = *value == 'n' ? '\n' : *value == 't' ? '\t' : *value;
+			} else {
+				*out++ = *value;
+			}
+		}
+		*out = 0;
+	} else {
+		str = pstrndup(p, value, value_end - value);
+	}
+	return auth_web_rule_compare(rule, str);
+}
+
+static void
+auth_web_rule_decide(unsigned int i, int matched)
+{
+	struct auth_web_rule *rule = &((struct auth_web_rule *) conf->rules->elts)[i];
+
+	rule_states[i] = matched != rule->deny ? AUTH_WEB_RULE_PASS : AUTH_WEB_RULE_FAIL;
+	pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": rule '%s' %s", rule->text,
+		rule_states[i] == AUTH_WEB_RULE_PASS ? "passed" : "failed");
+}
+
+/* Applies a response header line to the rules whose subject it is. Returns
+ * -1 as soon as a rule fails.
+ */
+static int
+auth_web_rules_header(const char *header)
+{
+	struct auth_web_rule *rule = (struct auth_web_rule *) conf->rules->elts;
+	const char *value;
+	register unsigned int i;
+	int failed = 0;
+
+	for (i = 0; i < conf->rules->nelts; ++i) {
+		if (rule[i].subject == AUTH_WEB_RULE_STATUS) {
+			if (strncmp(header, "HTTP/", 5) == 0 && !interim_response) {
+				auth_web_rule_decide(i, rule[i].status < 10 ?
+					response_status / 100 == rule[i].status :
+					response_status == rule[i].status);
+			}
+
+		} else if (rule[i].subject == AUTH_WEB_RULE_HEADER) {
+			if (strncmp(header, "HTTP/", 5) == 0) {
+				/* A new header block; forget the previous one. */
+				rule_states[i] = AUTH_WEB_RULE_UNKNOWN;
+
+			} else if (*header == 0) {
+				if (!interim_response && rule_states[i] == AUTH_WEB_RULE_UNKNOWN) {
+					auth_web_rule_decide(i, FALSE);
+				}
+
+			} else if (rule_states[i] == AUTH_WEB_RULE_UNKNOWN &&
+			           strncasecmp(header, rule[i].name, rule[i].name_len) == 0 &&
+			           header[rule[i].name_len] == ':') {
+				value = header + rule[i].name_len + 1;
+				while (*value == ' ' || *value == '\t') {
+					++value;
+				}
+				if (auth_web_rule_compare(&rule[i], value)) {
+					auth_web_rule_decide(i, TRUE);
+				}
+			}
+		}
+
+		if (rule_states[i] == AUTH_WEB_RULE_FAIL) {
+			failed = 1;
+			break;
+		}
+	}
+	return failed ? -1 : 0;
+}
+
+/* Decides every rule still undecided once the response is complete.
+ * Returns the first failing rule, or NULL.
+ */
+static struct auth_web_rule *
+auth_web_rules_finish(pool *p)
+{
+	struct auth_web_rule *rule = (struct auth_web_rule *) conf->rules->elts;
+	register unsigned int i;
+
+	for (i = 0; i < conf->rules->nelts; ++i) {
+		if (rule_states[i] == AUTH_WEB_RULE_UNKNOWN) {
+			auth_web_rule_decide(i, rule[i].subject == AUTH_WEB_RULE_JSON ?
+				auth_web_rule_json(p, &rule[i]) : FALSE);
+		}
+		if (rule_states[i] == AUTH_WEB_RULE_FAIL) {
+			return &rule[i];
+		}
+	}
+	return NULL;
+}
+
+/* Returns 1 once header decides the outcome: either every required header
+ * has been seen and every rule has passed, or the final header block has
+ * ended.
+ */
+static int
+auth_web_headers_decided(const char *header)
+{
+	char **required;
+	register unsigned int i;
+
+	if (*header == 0 && !interim_response) {
+		return 1;
+	}
+
+	if (conf->required_headers) {
+		required = (char **) conf->required_headers->elts;
+		for (i = 0; i < conf->required_headers->nelts; ++i) {
+			if (!required_matched[i] && strcmp(required[i], header) == 0) {
+				required_matched[i] = 1;
+				++nrequired_matched;
+			}
+		}
+		if (nrequired_matched < conf->required_headers->nelts) {
+			return 0;
+		}
+	}
+
+	for (i = 0; conf->rules && i < conf->rules->nelts; ++i) {
+		if (rule_states[i] != AUTH_WEB_RULE_PASS) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Counts len more bytes, and a header if header is set, of the current
+ * response, and returns 1 if that takes it over a limit, which decides the
+ * response.
+ */
+static int
+auth_web_response_exceeded(size_t len, int header)
+{
+	response_bytes += len;
+	nresponse_headers += header;
+	if ((conf->max_response_bytes > 0 &&
+	     response_bytes > (size_t) conf->max_response_bytes) ||
+	    (conf->max_headers > 0 &&
+	     nresponse_headers > (unsigned int) conf->max_headers)) {
+		pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": response exceeds %s, giving up on it",
+			header && conf->max_headers > 0 &&
+			nresponse_headers > (unsigned int) conf->max_headers ?
+			"AuthWebMaxHeaders" : "AuthWebMaxResponseBytes");
+		response_too_large = 1;
+		response_decided = 1;
+		return 1;
+	}
+	return 0;
+}
+
+static size_t
+get_response_headers(const void *buffer, const size_t size,
+                     const size_t nmemb, const void *userp)
+{
+	char *str;
+	unsigned int copy_len;
+
+	/* libcurl doesn't guarantee NULL termination, so make sure ourselves.
+	 * Don't copy the trailing CR/LF, if present.
+	 */
+	str = (char *) buffer;
+	copy_len = size * nmemb;
+	if (auth_web_response_exceeded(copy_len, 1)) {
+		return 0;
+	}
+	if (copy_len > 0 && (str[copy_len - 1] == '\r' || str[copy_len - 1] == '\n')) {
+		--copy_len;
+	}
+	if (copy_len > 0 && (str[copy_len - 1] == '\r' || str[copy_len - 1] == '\n')) {
+		--copy_len;
+	}
+
+	str = pstrndup(response_pool, str, copy_len);
+	if (!str) {
+		return 0;
+	}
+	pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": received response header: %s", (char *) str);
+
+	if (strncmp(str, "HTTP/", 5) == 0) {
+		/* 1xx responses, such as 100 Continue, and a proxy's CONNECT
+		 * response precede the real one. Only the final header block
+		 * counts, so forget what earlier ones matched.
+		 */
+		response_status = strchr(str, ' ') ? atoi(strchr(str, ' ') + 1) : 0;
+		interim_response = response_status / 100 == 1;
+		if (received_headers) {
+			received_headers->nelts = 0;
+		}
+		if (required_matched && conf->required_headers) {
+			memset(required_matched, 0, conf->required_headers->nelts);
+		}
+		nrequired_matched = 0;
+	}
+
+	if (received_headers == NULL) {
+		/* 16 is an arbitrary, but probably reasonable, number. */
+		received_headers = make_array(response_pool, 16, sizeof(char *));
+		if (received_headers == NULL) {
+			return 0;
+		}
+	}
+	*((char **) push_array(received_headers)) = str;
+
+	if (conf->rules) {
+		int64_t start = auth_web_now_usec();
+		int res = auth_web_rules_header(str);
+
+		rules_usec += auth_web_now_usec() - start;
+		if (res < 0) {
+			response_decided = 1;
+			return 0;
+		}
+	}
+
+	/* The body only matters for AuthWebLoginFailedString and JSON rules. */
+	if (conf->early_abort && (conf->required_headers || conf->rules) && !conf->failed_string &&
+	    !conf->rules_need_body && auth_web_headers_decided(str)) {
+		response_decided = 1;
+		return 0;
+	}
+
+	return size * nmemb;
+}
+
+static size_t
+get_response_data(const void *buffer, const size_t size,
+                  const size_t nmemb, const void *userp)
+{
+	const char *data = buffer;
+	size_t len = size * nmemb, matched = failed_string_matched;
+	register size_t i;
+
+	if (auth_web_response_exceeded(len, 0)) {
+		return 0;
+	}
+	if (conf->rules_need_body && rule_body_len < AUTH_WEB_RULE_BODY_MAX) {
+		i = AUTH_WEB_RULE_BODY_MAX - rule_body_len;
+		memcpy(rule_body + rule_body_len, data, len < i ? len : i);
+		rule_body_len += len < i ? len : i;
+	}
+
+	if (!conf->failed_string) {
+		return len;
+	}
+
+	for (i = 0; i < len && matched < conf->failed_string_len; ++i) {
+		while (matched > 0 && data[i] != conf->failed_string[matched]) {
+			matched = conf->failed_string_next[matched - 1];
+		}
+		if (data[i] == conf->failed_string[matched]) {
+			++matched;
+		}
+	}
+	failed_string_matched = matched;
+
+	if (matched == conf->failed_string_len && len > 0) {
+		/* Nothing later in the body can change the verdict. */
+		failed_string_found = 1;
+		response_decided = 1;
+		return 0;
+	}
+	return len;
+}
+
+static size_t *
+auth_web_kmp_table(pool *p, const char *pattern, size_t len)
+{
+	size_t *next, k = 0;
+	register size_t i;
+
+	next = palloc(p, (len ? len : 1) * sizeof(size_t));
+	next[0] = 0;
+	for (i = 1; i < len; ++i) {
+		while (k > 0 && pattern[i] != pattern[k]) {
+			k = next[k - 1];
+		}
+		if (pattern[i] == pattern[k]) {
+			++k;
+		}
+		next[i] = k;
+	}
+	return next;
+}
+
+static void
+auth_web_response_free(void)
+{
+	received_headers = NULL;
+	if (response_pool) {
+		destroy_pool(response_pool);
+		response_pool = NULL;
+	}
+}
+
+static void
+auth_web_response_reset(void)
+{
+	auth_web_response_free();
+	response_pool = make_sub_pool(session.pool);
+	response_bytes = 0;
+	nresponse_headers = 0;
+	response_too_large = 0;
+	failed_string_matched = 0;
+	failed_string_found = 0;
+	response_decided = 0;
+
+	interim_response = 0;
+	nrequired_matched = 0;
+	if (required_matched && conf->required_headers) {
+		memset(required_matched, 0, conf->required_headers->nelts);
+	}
+
+	response_status = 0;
+	rule_body_len = 0;
+	rules_usec = 0;
+	if (rule_states && conf->rules) {
+		memset(rule_states, 0, conf->rules->nelts);
+	}
+}
+
+/* Form encoding of each byte: the byte itself if it is safe, '+' for a
+ * space, and 0 if it must be escaped as %xx.
+ */
+static const unsigned char auth_web_url_safe[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	'+', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '-', '.', 0,
+	'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 0, 0, 0, 0, 0, 0,
+	0, 'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N', 'O',
+	'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z', 0, 0, 0, 0, '_',
+	0, 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o',
+	'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z', 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+#if defined(AUTH_WEB_SSE2)
+/* Returns 1 if all 16 bytes at str are alphanumerics, '-', '_', or '.'. */
+static int
+auth_web_url_safe16(const char *str)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *) str), safe;
+
+#define AUTH_WEB_IN_RANGE(lo, hi) \
+	_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((lo) - 1)), \
+		_mm_cmplt_epi8(v, _mm_set1_epi8((hi) + 1)))
+
+	/* High-bit bytes are negative here, so they fall outside every range. */
+	safe = _mm_or_si128(AUTH_WEB_IN_RANGE('0', '9'),
+		_mm_or_si128(AUTH_WEB_IN_RANGE('A', 'Z'), AUTH_WEB_IN_RANGE('a', 'z')));
+	safe = _mm_or_si128(safe, _mm_or_si128(AUTH_WEB_IN_RANGE('-', '.'),
+		_mm_cmpeq_epi8(v, _mm_set1_epi8('_'))));
+#undef AUTH_WEB_IN_RANGE
+
+	return _mm_movemask_epi8(safe) == 0xffff;
+}
+#elif defined(AUTH_WEB_NEON)
+static int
+auth_web_url_safe16(const char *str)
+{
+	uint8x16_t v = vld1q_u8((const uint8_t *) str), safe;
+
+#define AUTH_WEB_IN_RANGE(lo, hi) \
+	vandq_u8(vcgeq_u8(v, vdupq_n_u8(lo)), vcleq_u8(v, vdupq_n_u8(hi)))
+
+	safe = vorrq_u8(AUTH_WEB_IN_RANGE('0', '9'),
+		vorrq_u8(AUTH_WEB_IN_RANGE('A', 'Z'), AUTH_WEB_IN_RANGE('a', 'z')));
+	safe = vorrq_u8(safe, vorrq_u8(AUTH_WEB_IN_RANGE('-', '.'),
+		vceqq_u8(v, vdupq_n_u8('_'))));
+#undef AUTH_WEB_IN_RANGE
+
+	return vminvq_u8(safe) == 0xff;
+}
+#endif
+
+/* Writes the form encoding of the len bytes at str to dst, which must have
+ * room for three times as many, and returns the number of bytes written.
+ * dst is not NUL-terminated.
+ *
+ * Where SIMD is available, blocks of 16 safe bytes, the common case for
+ * token-style passwords, are copied through without being examined one by
+ * one.
+ */
+static size_t
+auth_web_urlencode(char *dst, const char *str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *check = (const unsigned char *) str,
+		*end = check + len;
+	char *track = dst;
+
+#if defined(AUTH_WEB_SSE2) || defined(AUTH_WEB_NEON)
+	const unsigned char *block_end;
+
+	while (end - check >= 16) {
+		if (auth_web_url_safe16((const char *) check)) {
+			memcpy(track, check, 16);
+			track += 16;
+			check += 16;
+			continue;
+		}
+
+		for (block_end = check + 16; check < block_end; ++check) {
+			if (auth_web_url_safe[*check]) {
+				*track++ = auth_web_url_safe[*check];
+			} else {
+				*track++ = '%';
+				*track++ = hex[*check >> 4];
+				*track++ = hex[*check & 0xf];
+			}
+		}
+	}
+#endif
+
+	for (; check < end; ++check) {
+		if (auth_web_url_safe[*check]) {
+			*track++ = auth_web_url_safe[*check];
+		} else {
+			*track++ = '%';
+			*track++ = hex[*check >> 4];
+			*track++ = hex[*check & 0xf];
+		}
+	}
+
+	return track - dst;
+}
+
+/* Escapes len bytes of str for a JSON string into dst, which must have
+ * room for 6 * len bytes, and returns the number of bytes written.
+ */
+static size_t
+auth_web_json_escape(char *dst, const char *str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *check = (const unsigned char *) str,
+		*end = check + len;
+	char *track = dst;
+
+	for (; check < end; ++check) {
+		if (*check == '"' || *check == '\\') {
+			*track++ = '\\';
+			*track++ = *check;
+		} else if (*check < 0x20) {
+			memcpy(track, "\\u00", 4);
+			track[4] = hex[*check >> 4];
+			track[5] = hex[*check & 0xf];
+			track += 6;
+		} else {
+			*track++ = *check;
+		}
+	}
+	return track - dst;
+}
+
+static size_t
+auth_web_base64(char *dst, const unsigned char *src, size_t len)
+{
+	static const char b64[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	char *track = dst;
+	unsigned long v;
+	register size_t i;
+
+	for (i = 0; i + 2 < len; i += 3) {
+		v = ((unsigned long) src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+		*track++ = b64[v >> 18];
+		*track++ = b64[(v >> 12) & 0x3f];
+		*track++ = b64[(v >> 6) & 0x3f];
+		*track++ = b64[v & 0x3f];
+	}
+	if (i < len) {
+		v = (unsigned long) src[i] << 16;
+		if (i + 1 < len) {
+			v |= src[i + 1] << 8;
+		}
+		*track++ = b64[v >> 18];
+		*track++ = b64[(v >> 12) & 0x3f];
+		*track++ = i + 1 < len ? b64[(v >> 6) & 0x3f] : '=';
+		*track++ = '=';
+	}
+	return track - dst;
+}
+
+/* Fills in the AuthWebExtraHeader templates with credential slots, in
+ * header_buf, which is kept and scrubbed like body_buf. Returns -1 if
+ * the credentials can't be put in a header.
+ */
+static int
+auth_web_headers_build(const char *username, const char *password)
+{
+	struct auth_web_tmpl *tmpls = (struct auth_web_tmpl *) conf->header_tmpls->elts;
+	size_t username_len = strlen(username), password_len = strlen(password),
+		slot_len, need = 0;
+	char *p;
+	register unsigned int i, j;
+
+	if (strpbrk(username, "\r\n") || strpbrk(password, "\r\n")) {
+		return -1;
+	}
+
+	/* Every slot fits in the Basic credentials' length. */
+	slot_len = 4 * ((username_len + 1 + password_len + 2) / 3);
+	for (i = 0; i < conf->header_tmpls->nelts; ++i) {
+		need += tmpls[i].fixed_len + tmpls[i].nslots * slot_len + 1;
+	}
+	if (need > header_buf_size) {
+		p = malloc(need);
+		if (!p) {
+			return -1;
+		}
+		auth_web_body_wipe();
+		free(header_buf);
+		header_buf = p;
+		header_buf_size = need;
+	}
+
+	p = header_buf;
+	for (i = 0; i < conf->header_tmpls->nelts; ++i) {
+		tmpls[i].node->data = p;
+		for (j = 0; j < tmpls[i].nparts; ++j) {
+			struct auth_web_tmpl_part *part = &tmpls[i].parts[j];
+
+			memcpy(p, part->text, part->len);
+			p += part->len;
+			switch (part->slot) {
+			case AUTH_WEB_SLOT_USER:
+				memcpy(p, username, username_len);
+				p += username_len;
+				break;
+
+			case AUTH_WEB_SLOT_PASS:
+				memcpy(p, password, password_len);
+				p += password_len;
+				break;
+
+			case AUTH_WEB_SLOT_BASIC: {
+				/* Encode user:pass in three-byte groups without
+				 * building the joined string.
+				 */
+				unsigned char group[3];
+				size_t n = 0, total = username_len + 1 + password_len, k;
+
+				for (k = 0; k < total; ++k) {
+					group[n++] = k < username_len ? username[k] :
+						k == username_len ? ':' : password[k - username_len - 1];
+					if (n == 3 || k + 1 == total) {
+						p += auth_web_base64(p, group, n);
+						n = 0;
+					}
+				}
+				pr_memscrub(group, sizeof(group));
+				break;
+			}
+			}
+		}
+		*p++ = 0;
+	}
+
+	header_len = p - header_buf;
+	return 0;
+}
+
+/* Builds the request body in body_buf, which each session allocates
+ * outside its pools and reuses for every login. The caller must scrub it
+ * with auth_web_body_wipe() once the request is done, so that no password
+ * outlives the login.
+ *
+ *   user_param_name=escaped_username&pass_param_name=escaped_password\0
+ *
+ * For GET, room is left in front of the body for auth_web_body_url() to
+ * put the URL.
+ */
+static char *
+auth_web_body_build(const char *username, const char *password)
+{
+	size_t username_len = strlen(username), password_len = strlen(password),
+		need, reserve;
+	size_t (*encode)(char *, const char *, size_t);
+	char *p;
+
+	encode = conf->body_format == AUTH_WEB_BODY_JSON ?
+		auth_web_json_escape : auth_web_urlencode;
+	reserve = conf->method == AUTH_WEB_METHOD_GET ? conf->max_url_len + 1 : 0;
+	need = reserve + conf->body_prefix_len + conf->body_infix_len +
+		conf->body_suffix_len + 6 * (username_len + password_len) + 1;
+	if (need > body_buf_size) {
+		p = malloc(need);
+		if (!p) {
+			return NULL;
+		}
+		auth_web_body_wipe();
+		free(body_buf);
+		body_buf = p;
+		body_buf_size = need;
+	}
+
+	p = body_buf + reserve;
+	if (conf->body_format != AUTH_WEB_BODY_NONE) {
+		memcpy(p, conf->body_prefix, conf->body_prefix_len);
+		p += conf->body_prefix_len;
+		p += encode(p, username, username_len);
+		memcpy(p, conf->body_infix, conf->body_infix_len);
+		p += conf->body_infix_len;
+		p += encode(p, password, password_len);
+		memcpy(p, conf->body_suffix, conf->body_suffix_len);
+		p += conf->body_suffix_len;
+	}
+	*p++ = 0;
+
+	body_len = p - body_buf;
+	return body_buf + reserve;
+}
+
+/* Returns url with the query string body appended, written into the room
+ * auth_web_body_build() left in front of body.
+ */
+static const char *
+auth_web_body_url(const char *url, char *body)
+{
+	size_t len = strlen(url);
+	char *dst;
+
+	if (*body == 0) {
+		return url;
+	}
+	dst = body - len - 1;
+	memcpy(dst, url, len);
+	dst[len] = strchr(url, '?') ? '&' : '?';
+	return dst;
+}
+
+static void
+auth_web_body_wipe(void)
+{
+	if (body_buf && body_len > 0) {
+		pr_memscrub(body_buf, body_len);
+		body_len = 0;
+	}
+	if (header_buf && header_len > 0) {
+		pr_memscrub(header_buf, header_len);
+		header_len = 0;
+	}
+}
+
+/* Compiles an AuthWebExtraHeader value into tmpl. Returns an error
+ * message, or NULL.
+ */
+static const char *
+auth_web_tmpl_compile(pool *p, const char *text, struct auth_web_tmpl *tmpl)
+{
+	array_header *parts = make_array(p, 2, sizeof(struct auth_web_tmpl_part));
+	struct auth_web_tmpl_part *part;
+	const char *start = text, *c;
+
+	memset(tmpl, 0, sizeof(*tmpl));
+	if (!strchr(text, ':') || strchr(text, ':') == text) {
+		return "expected 'Name: value'";
+	}
+
+	for (c = text; *c; ++c) {
+		int slot;
+
+		if (*c != '%') {
+			continue;
+		}
+		switch (c[1]) {
+		case 'u':
+			slot = AUTH_WEB_SLOT_USER;
+			break;
+		case 'p':
+			slot = AUTH_WEB_SLOT_PASS;
+			break;
+		case 'b':
+			slot = AUTH_WEB_SLOT_BASIC;
+			break;
+		case '%':
+			slot = AUTH_WEB_SLOT_NONE;
+			break;
+		default:
+			return "unknown % escape; expected %u, %p, %b, or %%";
+		}
+
+		part = push_array(parts);
+		part->text = start;
+		part->len = c - start + (slot == AUTH_WEB_SLOT_NONE);
+		part->slot = slot;
+		tmpl->fixed_len += part->len;
+		tmpl->nslots += slot != AUTH_WEB_SLOT_NONE;
+		start = c + 2;
+		++c;
+	}
+	part = push_array(parts);
+	part->text = start;
+	part->len = c - start;
+	part->slot = AUTH_WEB_SLOT_NONE;
+	tmpl->fixed_len += part->len;
+
+	tmpl->parts = parts->elts;
+	tmpl->nparts = parts->nelts;
+	return NULL;
+}
+
+static unsigned long
+auth_web_hash(const char *str, unsigned long hash)
+{
+	/* FNV-1a */
+	if (hash == 0) {
+		hash = 2166136261UL;
+	}
+	while (*str) {
+		hash ^= (unsigned char) *str++;
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+static int
+auth_web_literal_eq(struct auth_web_user_match *m, const char *str)
+{
+	register size_t i;
+
+	if (!m->any) {
+		return strncasecmp(str, m->literal, m->len) == 0;
+	}
+	for (i = 0; i < m->len; ++i) {
+		if (!m->any[i] && tolower((unsigned char) str[i]) !=
+		    tolower((unsigned char) m->literal[i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int
+auth_web_user_match(struct auth_web_user_match *m, const char *user)
+{
+	size_t len = strlen(user);
+	register size_t i;
+
+	switch (m->kind) {
+	case AUTH_WEB_MATCH_EXACT:
+		return len == m->len && auth_web_literal_eq(m, user);
+
+	case AUTH_WEB_MATCH_PREFIX:
+		return len >= m->len && auth_web_literal_eq(m, user);
+
+	case AUTH_WEB_MATCH_SUFFIX:
+		return len >= m->len && auth_web_literal_eq(m, user + len - m->len);
+
+	case AUTH_WEB_MATCH_CONTAINS:
+		for (i = 0; i + m->len <= len; ++i) {
+			if (auth_web_literal_eq(m, user + i)) {
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	return pr_regexp_exec(m->creg, user, 0, NULL, 0, 0, 0) == 0;
+}
+
+static int
+auth_web_suffix_match(struct auth_web_suffixes *set, pool *p, const char *user)
+{
+	size_t len = strlen(user);
+	unsigned long h;
+	char *lower, *suffix;
+	register unsigned int i, j;
+
+	lower = pstrdup(p, user);
+	for (i = 0; i < len; ++i) {
+		lower[i] = tolower((unsigned char) lower[i]);
+	}
+
+	for (i = 0; i < set->nlens; ++i) {
+		if (set->lens[i] > len) {
+			continue;
+		}
+		suffix = lower + len - set->lens[i];
+		h = auth_web_hash(suffix, 0);
+		for (j = h & set->mask; set->slots[j]; j = (j + 1) & set->mask) {
+			if (strcmp(set->slots[j], suffix) == 0) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+auth_web_user_allowed(pool *p, const char *user)
+{
+	if (conf->user_match && !auth_web_user_match(conf->user_match, user)) {
+		return 0;
+	}
+	if (conf->user_suffixes && !auth_web_suffix_match(conf->user_suffixes, p, user)) {
+		return 0;
+	}
+	return 1;
+}
+
+static struct auth_web_suffixes *
+auth_web_suffixes_create(pool *p, server_rec *s)
+{
+	struct auth_web_suffixes *set;
+	config_rec *c;
+	array_header *found;
+	unsigned int size, n;
+	size_t len;
+	char *suffix;
+	register unsigned int i, j;
+
+	found = make_array(p, 16, sizeof(char *));
+	for (c = find_config(s->conf, CONF_PARAM, "AuthWebUserSuffix", FALSE); c;
+	     c = find_config_next(c, c->next, CONF_PARAM, "AuthWebUserSuffix", FALSE)) {
+		for (i = 0; i < (unsigned int) c->argc; ++i) {
+			*((char **) push_array(found)) = c->argv[i];
+		}
+	}
+	if (found->nelts == 0) {
+		return NULL;
+	}
+
+	for (size = 16; size < 2 * found->nelts; size <<= 1);
+	set = pcalloc(p, sizeof(*set));
+	set->mask = size - 1;
+	set->slots = pcalloc(p, size * sizeof(char *));
+	set->lens = pcalloc(p, found->nelts * sizeof(size_t));
+
+	for (n = 0; n < found->nelts; ++n) {
+		suffix = pstrdup(p, ((char **) found->elts)[n]);
+		len = strlen(suffix);
+		for (i = 0; i < len; ++i) {
+			suffix[i] = tolower((unsigned char) suffix[i]);
+		}
+
+		for (j = auth_web_hash(suffix, 0) & set->mask; set->slots[j];
+		     j = (j + 1) & set->mask) {
+			if (strcmp(set->slots[j], suffix) == 0) {
+				break;
+			}
+		}
+		if (set->slots[j]) {
+			continue;
+		}
+		set->slots[j] = suffix;
+
+		for (i = 0; i < set->nlens && set->lens[i] != len; ++i);
+		if (i == set->nlens) {
+			set->lens[set->nlens++] = len;
+		}
+	}
+	return set;
+}
+
+static int
+auth_web_lock(volatile pid_t *lock)
+{
+	pid_t owner, self = getpid();
+	unsigned int spins;
+
+	for (spins = 0; !__sync_bool_compare_and_swap(lock, 0, self); ++spins) {
+		if (spins < AUTH_WEB_LOCK_SPINS) {
+			continue;
+		}
+
+		/* A session process that died while holding the lock would
+		 * otherwise wedge it until the next restart.
+		 */
+		owner = *lock;
+		if (owner != 0 && kill(owner, 0) < 0 && errno == ESRCH &&
+		    __sync_bool_compare_and_swap(lock, owner, self)) {
+			break;
+		}
+		return -1;
+	}
+	return 0;
+}
+
+static void
+auth_web_unlock(volatile pid_t *lock)
+{
+	__sync_lock_release(lock);
+}
+
+static char *
+auth_web_crypt(pool *p, const char *daemon_salt, const char *rounds,
+               const char *username, const char *password)
+{
+	static const char b64[] =
+		"./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+	char salt[AUTH_WEB_CACHE_SALT_LEN + 1], *hash;
+	unsigned long mix;
+	register unsigned int i;
+
+	/* Derive a per-user salt from the per-daemon random salt, so identical
+	 * passwords for different users don't produce identical hashes.
+	 */
+	mix = auth_web_hash(username, auth_web_hash(daemon_salt, 0));
+	for (i = 0; i < AUTH_WEB_CACHE_SALT_LEN; ++i) {
+		salt[i] = b64[((unsigned char) daemon_salt[i] + (mix & 0x3f)) & 0x3f];
+		mix = (mix >> 6) | (mix << (sizeof(mix) * 8 - 6));
+	}
+	salt[AUTH_WEB_CACHE_SALT_LEN] = 0;
+
+	hash = crypt(password, pstrcat(p, "$6$rounds=", rounds, "$", salt, "$",
+		NULL));
+	if (!hash || *hash == '*' || strlen(hash) >= AUTH_WEB_CACHE_HASH_LEN) {
+		return NULL;
+	}
+	return pstrdup(p, hash);
+}
+
+static char *
+auth_web_cache_hash(pool *p, const char *daemon_salt, const char *username,
+                    const char *password)
+{
+	return auth_web_crypt(p, daemon_salt, AUTH_WEB_CACHE_HASH_ROUNDS,
+		username, password);
+}
+
+static unsigned long
+auth_web_cache_key(const char *username)
+{
+	char sid[16];
+
+	snprintf(sid, sizeof(sid), "%u", main_server->sid);
+	return auth_web_hash(username, auth_web_hash(sid, 0));
+}
+
+/* Returns the key of the entry for username and hash in table. */
+static unsigned long
+auth_web_cache_entry_key(struct auth_web_cache *table, const char *username,
+                         const char *hash)
+{
+	unsigned long key = auth_web_cache_key(username);
+
+	return table->by_hash ? auth_web_hash(hash, key) : key;
+}
+
+/* Returns AUTH_WEB_CACHE_HIT if a valid entry matches, or
+ * AUTH_WEB_CACHE_STALE if it is older than soft_ttl (when non-zero) and
+ * the caller has claimed its refresh.
+ */
+static int
+auth_web_cache_lookup(struct auth_web_cache *table, const char *username,
+                      const char *hash, int soft_ttl)
+{
+	struct auth_web_cache_entry *entry;
+	unsigned long key = auth_web_cache_entry_key(table, username, hash);
+	time_t now = time(NULL);
+	pid_t owner;
+	register unsigned int i;
+	int found = AUTH_WEB_CACHE_MISS;
+
+	for (i = 0; i < table->probes && !found; ++i) {
+		entry = &table->entries[(key + i) % table->size];
+		if (entry->key != key || auth_web_lock(&entry->lock) < 0) {
+			continue;
+		}
+		if (entry->key == key && entry->sid == main_server->sid &&
+		    entry->expires > now && strcmp(entry->user, username) == 0 &&
+		    strcmp(entry->hash, hash) == 0) {
+			entry->used = now;
+			found = AUTH_WEB_CACHE_HIT;
+
+			owner = entry->refreshing;
+			if (soft_ttl > 0 && now - entry->stored >= soft_ttl &&
+			    (owner == 0 || (kill(owner, 0) < 0 && errno == ESRCH))) {
+				entry->refreshing = getpid();
+				found = AUTH_WEB_CACHE_STALE;
+			}
+		}
+		auth_web_unlock(&entry->lock);
+	}
+
+	__sync_fetch_and_add(found ? &table->hits : &table->misses, 1);
+	return found;
+}
+
+/* Hands the refresh claimed by a lookup over to pid, or gives it up if pid
+ * is 0.
+ */
+static void
+auth_web_cache_refreshing(struct auth_web_cache *table, const char *username,
+                          pid_t pid)
+{
+	struct auth_web_cache_entry *entry;
+	unsigned long key = auth_web_cache_key(username);
+	register unsigned int i;
+
+	for (i = 0; i < table->probes; ++i) {
+		entry = &table->entries[(key + i) % table->size];
+		if (entry->key == key && entry->sid == main_server->sid &&
+		    strcmp(entry->user, username) == 0) {
+			entry->refreshing = pid;
+			return;
+		}
+	}
+}
+
+/* Drops any entry for username, such as one whose password has been
+ * revoked.
+ */
+static void
+auth_web_cache_forget(struct auth_web_cache *table, const char *username)
+{
+	struct auth_web_cache_entry *entry;
+	unsigned long key = auth_web_cache_key(username);
+	register unsigned int i;
+
+	for (i = 0; i < table->probes; ++i) {
+		entry = &table->entries[(key + i) % table->size];
+		if (entry->key != key || auth_web_lock(&entry->lock) < 0) {
+			continue;
+		}
+		if (entry->key == key && entry->sid == main_server->sid &&
+		    strcmp(entry->user, username) == 0) {
+			entry->expires = 0;
+			entry->refreshing = 0;
+		}
+		auth_web_unlock(&entry->lock);
+	}
+}
+
+static void
+auth_web_cache_store(struct auth_web_cache *table, const char *username,
+                     const char *hash, int ttl)
+{
+	struct auth_web_cache_entry *entry, *victim = NULL;
+	unsigned long key = auth_web_cache_entry_key(table, username, hash);
+	time_t now = time(NULL);
+	register unsigned int i;
+
+	if (strlen(username) >= AUTH_WEB_CACHE_USER_LEN) {
+		return;
+	}
+
+	/* Prefer this user's existing bucket, then an expired one, then
+	 * whichever live entry the eviction policy gives up. The scan is done
+	 * unlocked; losing a race here only costs a cache entry.
+	 */
+	for (i = 0; i < table->probes; ++i) {
+		entry = &table->entries[(key + i) % table->size];
+		if (entry->key == key && entry->sid == main_server->sid &&
+		    strcmp(entry->user, username) == 0 &&
+		    (!table->by_hash || strcmp(entry->hash, hash) == 0)) {
+			victim = entry;
+			break;
+		}
+		if (victim && victim->expires <= now) {
+			continue;
+		}
+		if (!victim || entry->expires <= now ||
+		    (table->eviction == AUTH_WEB_CACHE_EVICT_LRU ?
+		     entry->used < victim->used : entry->stored < victim->stored)) {
+			victim = entry;
+		}
+	}
+
+	if (auth_web_lock(&victim->lock) < 0) {
+		return;
+	}
+	if (victim->expires > now && strcmp(victim->user, username) != 0) {
+		__sync_fetch_and_add(&table->evictions, 1);
+	}
+	victim->key = key;
+	victim->sid = main_server->sid;
+	victim->stored = victim->used = now;
+	victim->expires = now + ttl;
+	victim->refreshing = 0;
+	sstrncpy(victim->user, username, sizeof(victim->user));
+	sstrncpy(victim->hash, hash, sizeof(victim->hash));
+	if (cookies && table == cache) {
+		pr_memscrub(&cookies[victim - table->entries], sizeof(*cookies));
+	}
+	auth_web_unlock(&victim->lock);
+
+	__sync_fetch_and_add(&table->stores, 1);
+}
+
+/* Returns the live offline entry for username, found without locking, so
+ * that callers can skip the slow hash when there is nothing to compare it
+ * with.
+ */
+static struct auth_web_cache_entry *
+auth_web_offline_find(const char *username)
+{
+	struct auth_web_cache_entry *entry;
+	unsigned long key = auth_web_cache_key(username);
+	time_t now = time(NULL);
+	register unsigned int i;
+
+	for (i = 0; i < offline->probes; ++i) {
+		entry = &offline->entries[(key + i) % offline->size];
+		if (entry->key == key && entry->sid == main_server->sid &&
+		    entry->expires > now && strcmp(entry->user, username) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static char *
+auth_web_offline_hash(pool *p, const char *username, const char *password)
+{
+	return auth_web_crypt(p, offline->salt, AUTH_WEB_OFFLINE_HASH_ROUNDS,
+		username, password);
+}
+
+/* Returns the cheap hash that offline_prints keys password on: cache_hash
+ * when the credential cache already computed it.
+ */
+static const char *
+auth_web_offline_print(pool *p, const char *username, const char *password,
+                       const char *cache_hash)
+{
+	if (cache_hash) {
+		return cache_hash;
+	}
+	return auth_web_cache_hash(p, offline_prints->salt, username, password);
+}
+
+/* Records a login that AuthWebURL accepted. An entry written for the same
+ * password with more than half its TTL left is kept as it is, so the slow
+ * hash runs at most about twice per TTL for each user unless the password
+ * changes.
+ */
+static void
+auth_web_offline_store(pool *p, const char *username, const char *password,
+                       const char *cache_hash)
+{
+	struct auth_web_cache_entry *entry = auth_web_offline_find(username);
+	const char *print;
+	char *hash;
+
+	print = auth_web_offline_print(p, username, password, cache_hash);
+	if (!print) {
+		return;
+	}
+	if (entry && entry->expires - time(NULL) > offline_ttl / 2 &&
+	    auth_web_cache_lookup(offline_prints, username, print, 0) == AUTH_WEB_CACHE_HIT) {
+		return;
+	}
+	hash = auth_web_offline_hash(p, username, password);
+	if (hash) {
+		auth_web_cache_store(offline, username, hash, offline_ttl);
+		auth_web_cache_store(offline_prints, username, print, offline_ttl);
+	}
+}
+
+/* Returns 0 if password is the one AuthWebURL last accepted for username,
+ * within the TTL.
+ */
+static int
+auth_web_offline_verify(pool *p, const char *username, const char *password)
+{
+	char *hash;
+
+	if (!auth_web_offline_find(username)) {
+		return -1;
+	}
+	hash = auth_web_offline_hash(p, username, password);
+	if (!hash || auth_web_cache_lookup(offline, username, hash, 0) != AUTH_WEB_CACHE_HIT) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Drops the offline entry for username after AuthWebURL rejected the
+ * password it was written for, which has therefore been changed. Other
+ * rejected passwords are only guesses, and leave it alone; so does any
+ * password when offline_prints no longer knows which the entry holds, as
+ * after a restart, leaving the entry to expire.
+ */
+static void
+auth_web_offline_forget(pool *p, const char *username, const char *password,
+                        const char *cache_hash)
+{
+	struct auth_web_cache_entry *entry = auth_web_offline_find(username);
+	const char *print;
+
+	if (!entry) {
+		return;
+	}
+	print = auth_web_offline_print(p, username, password, cache_hash);
+	if (!print ||
+	    auth_web_cache_lookup(offline_prints, username, print, 0) != AUTH_WEB_CACHE_HIT ||
+	    auth_web_lock(&entry->lock) < 0) {
+		return;
+	}
+	if (entry->sid == main_server->sid && strcmp(entry->user, username) == 0) {
+		pr_log_pri(PR_LOG_INFO, MOD_AUTH_WEB_VERSION ": password on file for user %s rejected, dropping offline entry", username);
+		entry->expires = 0;
+	}
+	auth_web_unlock(&entry->lock);
+}
+
+/* Reads exactly len bytes, giving up at deadline (if non-zero). Signals are
+ * handled while waiting, so the session's own timers keep working.
+ */
+static int
+auth_web_read_full(int fd, void *buf, size_t len, time_t deadline)
+{
+	struct pollfd pfd;
+	time_t now;
+	ssize_t n;
+	int res;
+
+	while (len > 0) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		res = poll(&pfd, 1, 1000);
+		if (res < 0 && errno != EINTR) {
+			return -1;
+		}
+		pr_signals_handle();
+		if (res <= 0) {
+			now = time(NULL);
+			if (deadline && now >= deadline) {
+				errno = ETIMEDOUT;
+				return -1;
+			}
+			continue;
+		}
+
+		n = read(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		buf = (char *) buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* version is an AUTH_WEB_HTTP_* value. For HTTP/2, a request waits for a
+ * connection that is still being set up rather than opening another, so
+ * that concurrent requests share one connection as separate streams.
+ */
+static void
+auth_web_set_http_version(CURL *handle, int version)
+{
+	switch (version) {
+	case AUTH_WEB_HTTP_1_0:
+		curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_1_0);
+		break;
+
+	case AUTH_WEB_HTTP_1_1:
+		curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_1_1);
+		break;
+
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	case AUTH_WEB_HTTP_2:
+		curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+		curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+		break;
+#endif
+	}
+}
+
+static void
+auth_web_set_timeouts(CURL *handle, long connect, long total, long low_speed)
+{
+	curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, connect);
+	curl_easy_setopt(handle, CURLOPT_TIMEOUT, total);
+	if (low_speed > 0) {
+		curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
+		curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, low_speed);
+	}
+}
+
+/* Drives a transfer with a multi handle rather than curl_easy_perform(), so
+ * that signals (and the timers they drive) are handled while it runs. The
+ * multi handle, which holds the connection cache, is kept with the easy
+ * handle.
+ */
+static CURLcode
+auth_web_multi_perform(CURL *handle)
+{
+	CURLM *multi;
+	CURLMcode mres;
+	CURLMsg *msg;
+	CURLcode res = CURLE_FAILED_INIT;
+	int running, left;
+
+	if (!easy_multi) {
+		easy_multi = curl_multi_init();
+	}
+	multi = easy_multi;
+	if (!multi) {
+		return res;
+	}
+	if (curl_multi_add_handle(multi, handle) != CURLM_OK) {
+		return res;
+	}
+
+	do {
+		mres = curl_multi_perform(multi, &running);
+		if (mres == CURLM_OK && running) {
+			mres = curl_multi_wait(multi, NULL, 0, 1000, NULL);
+		}
+		pr_signals_handle();
+	} while (mres == CURLM_OK && running);
+
+	while ((msg = curl_multi_info_read(multi, &left))) {
+		if (msg->msg == CURLMSG_DONE && msg->easy_handle == handle) {
+			res = msg->data.result;
+		}
+	}
+
+	curl_multi_remove_handle(multi, handle);
+	return res;
+}
+
+static char *
+auth_web_add_field(char *buf, uint32_t type, const char *str)
+{
+	struct auth_web_frame frame;
+
+	frame.type = type;
+	frame.len = strlen(str) + 1;
+	memcpy(buf, &frame, sizeof(frame));
+	memcpy(buf + sizeof(frame), str, frame.len);
+	return buf + sizeof(frame) + frame.len;
+}
+
+/* Performs the request through the broker, feeding the response to the same
+ * callbacks libcurl would. Returns -1 if the broker couldn't be reached, so
+ * the caller can perform the request itself.
+ */
+static int
+auth_web_broker_perform(pool *p, const char *url, const char *post_data,
+                        struct curl_slist *headers, CURLcode *result,
+                        char *error)
+{
+	struct auth_web_frame frame;
+	struct curl_slist *header;
+	char chunk[CURL_MAX_WRITE_SIZE], *req, *end, *buf;
+	int32_t options[4];
+	uint32_t req_len, n;
+	time_t deadline = 0;
+	int fd, res;
+
+	req_len = 2 * sizeof(frame) + strlen(url) + 1 + sizeof(options);
+	if (post_data) {
+		req_len += sizeof(frame) + strlen(post_data) + 1;
+	}
+	for (header = headers; header; header = header->next) {
+		req_len += sizeof(frame) + strlen(header->data) + 1;
+	}
+	if (req_len > AUTH_WEB_BROKER_MAX_REQUEST) {
+		return -1;
+	}
+
+	req = palloc(p, sizeof(req_len) + req_len);
+	memcpy(req, &req_len, sizeof(req_len));
+	end = auth_web_add_field(req + sizeof(req_len), AUTH_WEB_FRAME_URL, url);
+	if (post_data) {
+		end = auth_web_add_field(end, AUTH_WEB_FRAME_POSTFIELDS, post_data);
+	}
+	for (header = headers; header; header = header->next) {
+		end = auth_web_add_field(end, AUTH_WEB_FRAME_HEADER, header->data);
+	}
+	options[0] = conf->connect_timeout;
+	options[1] = conf->total_timeout;
+	options[2] = conf->low_speed_timeout;
+	options[3] = conf->http_version;
+	frame.type = AUTH_WEB_FRAME_OPTIONS;
+	frame.len = sizeof(options);
+	memcpy(end, &frame, sizeof(frame));
+	memcpy(end + sizeof(frame), options, sizeof(options));
+	end += sizeof(frame) + sizeof(options);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	/* The socket is only accessible to root. */
+	PRIVS_ROOT
+	res = connect(fd, (struct sockaddr *) &broker_addr, sizeof(broker_addr));
+	PRIVS_RELINQUISH
+	if (res == 0) {
+		res = send(fd, req, end - req, MSG_NOSIGNAL) == end - req ? 0 : -1;
+	}
+	pr_memscrub(req, end - req);
+	if (res < 0) {
+		pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": unable to reach broker at %s: %s", broker_addr.sun_path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	*result = CURLE_RECV_ERROR;
+	snprintf(error, CURL_ERROR_SIZE, "lost connection to broker");
+
+	/* The broker enforces the timeout; this only guards against a wedged
+	 * broker.
+	 */
+	if (conf->total_timeout > 0) {
+		deadline = time(NULL) + conf->total_timeout + 5;
+	}
+
+	while (auth_web_read_full(fd, &frame, sizeof(frame), deadline) == 0) {
+		if (frame.type == AUTH_WEB_FRAME_HEADER) {
+			/* libcurl never passes on a longer header. */
+			if (frame.len > AUTH_WEB_BROKER_MAX_HEADER) {
+				*result = CURLE_WRITE_ERROR;
+				break;
+			}
+			if (conf->max_response_bytes > 0 &&
+			    frame.len > (uint32_t) conf->max_response_bytes) {
+				auth_web_response_exceeded(frame.len, 1);
+				*result = CURLE_WRITE_ERROR;
+				break;
+			}
+			buf = frame.len <= sizeof(chunk) ? chunk : palloc(response_pool, frame.len);
+			if (auth_web_read_full(fd, buf, frame.len, deadline) < 0) {
+				break;
+			}
+			if (frame.len > 0 &&
+			    get_response_headers(buf, 1, frame.len, NULL) != frame.len) {
+				*result = CURLE_WRITE_ERROR;
+				break;
+			}
+
+		} else if (frame.type == AUTH_WEB_FRAME_DATA) {
+			while (frame.len > 0) {
+				n = frame.len < sizeof(chunk) ? frame.len : sizeof(chunk);
+				if (auth_web_read_full(fd, chunk, n, deadline) < 0 ||
+				    get_response_data(chunk, 1, n, NULL) != n) {
+					break;
+				}
+				frame.len -= n;
+			}
+			if (frame.len > 0) {
+				*result = CURLE_WRITE_ERROR;
+				break;
+			}
+
+		} else if (frame.type == AUTH_WEB_FRAME_TIMINGS &&
+		           frame.len == sizeof(timings)) {
+			if (auth_web_read_full(fd, &timings, sizeof(timings), deadline) < 0) {
+				break;
+			}
+			timings_valid = 1;
+
+		} else if (frame.type == AUTH_WEB_FRAME_DONE &&
+		           frame.len > sizeof(int32_t) && frame.len <= sizeof(chunk)) {
+			if (auth_web_read_full(fd, chunk, frame.len, deadline) == 0) {
+				int32_t code;
+
+				memcpy(&code, chunk, sizeof(code));
+				*result = (CURLcode) code;
+				sstrncpy(error, chunk + sizeof(code), CURL_ERROR_SIZE);
+			}
+			break;
+
+		} else {
+			break;
+		}
+	}
+
+	close(fd);
+	return 0;
+}
+
+static void auth_web_timings_collect(CURL *handle,
+                                     struct auth_web_timings *t);
+static unsigned int auth_web_warm_up_add(CURLM *multi, int direct);
+static void auth_web_warm_up_done(CURLM *multi, CURL *handle, CURLcode res,
+                                  int direct);
+
+/* Writes as much queued output as the session's socket takes without
+ * blocking. Returns -1 once the session has gone away.
+ */
+static int
+auth_web_broker_flush(struct auth_web_broker_conn *conn)
+{
+	ssize_t n;
+
+	while (!conn->failed && conn->out_off < conn->out_len) {
+		n = write(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		}
+		if (n <= 0) {
+			conn->failed = 1;
+			break;
+		}
+		conn->out_off += n;
+	}
+	if (conn->out_off == conn->out_len) {
+		conn->out_off = conn->out_len = 0;
+	}
+	return conn->failed ? -1 : 0;
+}
+
+/* Queues a frame for the session, and sends what its socket takes now. */
+static int
+auth_web_broker_send(struct auth_web_broker_conn *conn, uint32_t type,
+                     const void *data, uint32_t len)
+{
+	struct auth_web_frame frame;
+	size_t need, size;
+	char *out;
+
+	if (conn->failed) {
+		return -1;
+	}
+	if (conn->out_off > 0) {
+		memmove(conn->out, conn->out + conn->out_off, conn->out_len - conn->out_off);
+		conn->out_len -= conn->out_off;
+		conn->out_off = 0;
+	}
+
+	need = conn->out_len + sizeof(frame) + len;
+	if (need > conn->out_size) {
+		for (size = conn->out_size ? conn->out_size : 16384; size < need; size *= 2) {
+		}
+		out = realloc(conn->out, size);
+		if (!out) {
+			conn->failed = 1;
+			return -1;
+		}
+		conn->out = out;
+		conn->out_size = size;
+	}
+
+	frame.type = type;
+	frame.len = len;
+	memcpy(conn->out + conn->out_len, &frame, sizeof(frame));
+	memcpy(conn->out + conn->out_len + sizeof(frame), data, len);
+	conn->out_len = need;
+	return auth_web_broker_flush(conn);
+}
+
+static size_t
+auth_web_broker_header_cb(char *buffer, size_t size, size_t nmemb, void *userp)
+{
+	struct auth_web_broker_conn *conn = userp;
+
+	if (auth_web_broker_send(conn, AUTH_WEB_FRAME_HEADER, buffer, size * nmemb) < 0) {
+		return 0;
+	}
+	return size * nmemb;
+}
+
+static size_t
+auth_web_broker_data_cb(char *buffer, size_t size, size_t nmemb, void *userp)
+{
+	struct auth_web_broker_conn *conn = userp;
+
+	/* Wait for the session to catch up; libcurl delivers this again. */
+	if (conn->out_len - conn->out_off >= AUTH_WEB_BROKER_MAX_QUEUE) {
+		conn->paused = 1;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+	if (auth_web_broker_send(conn, AUTH_WEB_FRAME_DATA, buffer, size * nmemb) < 0) {
+		return 0;
+	}
+	return size * nmemb;
+}
+
+static int
+auth_web_broker_start_request(CURLM *multi, struct auth_web_broker_conn *conn)
+{
+	struct auth_web_frame frame;
+	char *field = conn->buf, *end = conn->buf + conn->want;
+	const char *req_url = NULL, *req_post = NULL;
+	int32_t options[4] = { 0, 0, 0, 0 };
+
+	while (field + sizeof(frame) <= end) {
+		memcpy(&frame, field, sizeof(frame));
+		field += sizeof(frame);
+		if (frame.len == 0 || frame.len > (uint32_t) (end - field)) {
+			return -1;
+		}
+		if (frame.type == AUTH_WEB_FRAME_OPTIONS) {
+			if (frame.len != sizeof(options)) {
+				return -1;
+			}
+			memcpy(options, field, sizeof(options));
+			field += frame.len;
+			continue;
+		}
+		if (field[frame.len - 1] != 0) {
+			return -1;
+		}
+
+		switch (frame.type) {
+		case AUTH_WEB_FRAME_URL:
+			req_url = field;
+			break;
+		case AUTH_WEB_FRAME_POSTFIELDS:
+			req_post = field;
+			break;
+		case AUTH_WEB_FRAME_HEADER:
+			conn->headers = curl_slist_append(conn->headers, field);
+			break;
+		default:
+			return -1;
+		}
+		field += frame.len;
+	}
+	if (!req_url) {
+		return -1;
+	}
+
+	conn->curl = curl_easy_init();
+	if (!conn->curl) {
+		return -1;
+	}
+	curl_easy_setopt(conn->curl, CURLOPT_PRIVATE, conn);
+	curl_easy_setopt(conn->curl, CURLOPT_URL, req_url);
+	if (req_post) {
+		curl_easy_setopt(conn->curl, CURLOPT_POSTFIELDS, req_post);
+	}
+	curl_easy_setopt(conn->curl, CURLOPT_HTTPHEADER, conn->headers);
+	curl_easy_setopt(conn->curl, CURLOPT_ERRORBUFFER, conn->error);
+	curl_easy_setopt(conn->curl, CURLOPT_HEADERFUNCTION, auth_web_broker_header_cb);
+	curl_easy_setopt(conn->curl, CURLOPT_HEADERDATA, conn);
+	curl_easy_setopt(conn->curl, CURLOPT_WRITEFUNCTION, auth_web_broker_data_cb);
+	curl_easy_setopt(conn->curl, CURLOPT_WRITEDATA, conn);
+	curl_easy_setopt(conn->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	auth_web_set_timeouts(conn->curl, options[0], options[1], options[2]);
+	auth_web_set_http_version(conn->curl, options[3]);
+
+	return curl_multi_add_handle(multi, conn->curl) == CURLM_OK ? 0 : -1;
+}
+
+/* Ends conn's transfer, if any, queueing its TIMINGS and DONE frames. */
+static void
+auth_web_broker_finish(CURLM *multi, struct auth_web_broker_conn *conn,
+                       CURLcode result)
+{
+	char done[sizeof(int32_t) + CURL_ERROR_SIZE];
+	int32_t code = result;
+	size_t len;
+
+	if (conn->curl) {
+		struct auth_web_timings t;
+
+		memset(&t, 0, sizeof(t));
+		auth_web_timings_collect(conn->curl, &t);
+		auth_web_broker_send(conn, AUTH_WEB_FRAME_TIMINGS, &t, sizeof(t));
+
+		memcpy(done, &code, sizeof(code));
+		len = strlen(conn->error);
+		if (len == 0 && result != CURLE_OK) {
+			sstrncpy(conn->error, curl_easy_strerror(result), sizeof(conn->error));
+			len = strlen(conn->error);
+		}
+		memcpy(done + sizeof(code), conn->error, len + 1);
+		auth_web_broker_send(conn, AUTH_WEB_FRAME_DONE, done, sizeof(code) + len + 1);
+
+		curl_multi_remove_handle(multi, conn->curl);
+		curl_easy_cleanup(conn->curl);
+		conn->curl = NULL;
+	}
+	curl_slist_free_all(conn->headers);
+	conn->headers = NULL;
+	conn->done = 1;
+}
+
+static void
+auth_web_broker_close(struct auth_web_broker_conn **list,
+                      struct auth_web_broker_conn *conn)
+{
+	struct auth_web_broker_conn **prev;
+
+	close(conn->fd);
+	for (prev = list; *prev; prev = &(*prev)->next) {
+		if (*prev == conn) {
+			*prev = conn->next;
+			break;
+		}
+	}
+	if (conn->buf) {
+		pr_memscrub(conn->buf, conn->want);
+	}
+	free(conn->out);
+	destroy_pool(conn->pool);
+}
+
+/* Reads as much of a pending request as is available. Returns 1 once the
+ * request is complete, 0 if more is needed, and -1 on error or EOF.
+ */
+static int
+auth_web_broker_read(struct auth_web_broker_conn *conn)
+{
+	ssize_t n;
+
+	if (conn->buf == NULL) {
+		n = read(conn->fd, (char *) &conn->want + conn->have,
+			sizeof(conn->want) - conn->have);
+		if (n <= 0) {
+			return n < 0 && errno == EAGAIN ? 0 : -1;
+		}
+		conn->have += n;
+		if (conn->have < sizeof(conn->want)) {
+			return 0;
+		}
+		if (conn->want == 0 || conn->want > AUTH_WEB_BROKER_MAX_REQUEST) {
+			return -1;
+		}
+		conn->buf = palloc(conn->pool, conn->want);
+		conn->have = 0;
+	}
+
+	n = read(conn->fd, conn->buf + conn->have, conn->want - conn->have);
+	if (n <= 0) {
+		return n < 0 && errno == EAGAIN ? 0 : -1;
+	}
+	conn->have += n;
+	return conn->have == conn->want ? 1 : 0;
+}
+
+/* ready_fd is closed once the warm-up requests, if any, have finished. */
+static void
+auth_web_broker_main(int listen_fd, int parent_fd, int ready_fd,
+                     long max_conns, long max_streams)
+{
+	struct curl_waitfd *waitfds = NULL, *grown;
+	struct auth_web_broker_conn *conns = NULL, *conn, *next;
+	unsigned int nfds, nconns = 0, max_fds = 0, pending, warming;
+	CURLM *multi;
+	CURLMsg *msg;
+	int running, left, fd;
+
+	multi = curl_multi_init();
+	if (!multi) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": broker unable to initialize libcurl");
+		return;
+	}
+	curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, max_conns);
+#if LIBCURL_VERSION_NUM >= 0x072b00
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x074300
+	curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, max_streams);
+#endif
+
+	pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": broker listening on %s", broker_addr.sun_path);
+
+	/* Warm-up transfers leave their connections in the multi handle's
+	 * pool, ready for the first logins.
+	 */
+	warming = auth_web_warm_up_add(multi, FALSE);
+	if (warming == 0) {
+		close(ready_fd);
+	}
+
+	for (;;) {
+		if (nconns + 2 > max_fds) {
+			grown = realloc(waitfds, (nconns + 2) * sizeof(*waitfds));
+			if (!grown) {
+				pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": broker out of memory");
+				break;
+			}
+			waitfds = grown;
+			max_fds = nconns + 2;
+		}
+
+		nfds = 0;
+		waitfds[nfds].fd = parent_fd;
+		waitfds[nfds].events = CURL_WAIT_POLLIN;
+		waitfds[nfds++].revents = 0;
+
+		pending = 0;
+		for (conn = conns; conn; conn = conn->next) {
+			if (conn->out_off < conn->out_len) {
+				waitfds[nfds].fd = conn->fd;
+				waitfds[nfds].events = CURL_WAIT_POLLOUT;
+				waitfds[nfds++].revents = 0;
+
+			} else if (conn->curl == NULL && !conn->done &&
+			           pending < AUTH_WEB_BROKER_MAX_PENDING) {
+				waitfds[nfds].fd = conn->fd;
+				waitfds[nfds].events = CURL_WAIT_POLLIN;
+				waitfds[nfds++].revents = 0;
+				++pending;
+			}
+		}
+		if (pending < AUTH_WEB_BROKER_MAX_PENDING) {
+			waitfds[nfds].fd = listen_fd;
+			waitfds[nfds].events = CURL_WAIT_POLLIN;
+			waitfds[nfds++].revents = 0;
+		}
+
+		curl_multi_wait(multi, waitfds, nfds, 1000, NULL);
+
+		/* The daemon holds the other end; EOF means it has gone away. */
+		if (waitfds[0].revents) {
+			break;
+		}
+
+		if (waitfds[nfds - 1].fd == listen_fd && waitfds[nfds - 1].revents) {
+			while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+				pool *conn_pool = make_sub_pool(permanent_pool);
+
+				conn = pcalloc(conn_pool, sizeof(*conn));
+				conn->pool = conn_pool;
+				conn->fd = fd;
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+				conn->next = conns;
+				conns = conn;
+				++nconns;
+			}
+		}
+
+		for (conn = conns; conn; conn = next) {
+			next = conn->next;
+
+			if (conn->out_off < conn->out_len || conn->failed) {
+				auth_web_broker_flush(conn);
+				if (conn->failed && conn->curl) {
+					/* The session has gone; abandon its transfer. */
+					auth_web_broker_finish(multi, conn, CURLE_WRITE_ERROR);
+				}
+				if (conn->paused && !conn->failed &&
+				    conn->out_len - conn->out_off < AUTH_WEB_BROKER_MAX_QUEUE / 2) {
+					conn->paused = 0;
+					curl_easy_pause(conn->curl, CURLPAUSE_CONT);
+				}
+			}
+			if (conn->done) {
+				if (conn->failed || conn->out_off == conn->out_len) {
+					auth_web_broker_close(&conns, conn);
+					--nconns;
+				}
+				continue;
+			}
+			if (conn->curl) {
+				continue;
+			}
+
+			switch (auth_web_broker_read(conn)) {
+			case 0:
+				break;
+			case 1:
+				if (auth_web_broker_start_request(multi, conn) == 0) {
+					break;
+				}
+				if (conn->curl) {
+					curl_easy_cleanup(conn->curl);
+					conn->curl = NULL;
+				}
+				/* FALLTHROUGH */
+			default:
+				auth_web_broker_finish(multi, conn, CURLE_OK);
+				auth_web_broker_close(&conns, conn);
+				--nconns;
+				break;
+			}
+		}
+
+		curl_multi_perform(multi, &running);
+		while ((msg = curl_multi_info_read(multi, &left))) {
+			if (msg->msg != CURLMSG_DONE) {
+				continue;
+			}
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &conn);
+			if (conn == NULL) {
+				auth_web_warm_up_done(multi, msg->easy_handle, msg->data.result, FALSE);
+				if (--warming == 0) {
+					close(ready_fd);
+				}
+				continue;
+			}
+			auth_web_broker_finish(multi, conn, msg->data.result);
+			if (conn->failed || conn->out_off == conn->out_len) {
+				auth_web_broker_close(&conns, conn);
+				--nconns;
+			}
+		}
+	}
+
+	for (conn = conns; conn; conn = next) {
+		next = conn->next;
+		auth_web_broker_finish(multi, conn, CURLE_ABORTED_BY_CALLBACK);
+		auth_web_broker_close(&conns, conn);
+	}
+	curl_multi_cleanup(multi);
+	free(waitfds);
+}
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+static CURLcode
+auth_web_tls_export_cb(CURL *handle, void *userp, const char *session_key,
+                       const unsigned char *shmac, size_t shmac_len,
+                       const unsigned char *sdata, size_t sdata_len,
+                       curl_off_t valid_until, int ietf_tls_id,
+                       const char *alpn, size_t earlydata_max)
+{
+	struct auth_web_tls_session *entry, *victim = NULL;
+	register unsigned int i;
+
+	if (strlen(session_key) >= AUTH_WEB_TLS_KEY_LEN ||
+	    shmac_len > AUTH_WEB_TLS_HMAC_LEN || sdata_len > AUTH_WEB_TLS_DATA_LEN) {
+		return CURLE_OK;
+	}
+
+	for (i = 0; i < AUTH_WEB_TLS_SESSIONS; ++i) {
+		entry = &tls_sessions[i];
+		if (strcmp(entry->key, session_key) == 0) {
+			victim = entry;
+			break;
+		}
+		if (!victim || entry->stored < victim->stored) {
+			victim = entry;
+		}
+	}
+
+	if (auth_web_lock(&victim->lock) < 0) {
+		return CURLE_OK;
+	}
+	victim->stored = time(NULL);
+	victim->valid_until = (time_t) valid_until;
+	sstrncpy(victim->key, session_key, sizeof(victim->key));
+	memcpy(victim->shmac, shmac, shmac_len);
+	victim->shmac_len = shmac_len;
+	memcpy(victim->sdata, sdata, sdata_len);
+	victim->sdata_len = sdata_len;
+	auth_web_unlock(&victim->lock);
+
+	return CURLE_OK;
+}
+#endif
+
+static void
+auth_web_tls_import(CURL *handle)
+{
+#if LIBCURL_VERSION_NUM >= 0x080c00
+	struct auth_web_tls_session *entry;
+	time_t now = time(NULL);
+	register unsigned int i;
+
+	if (!tls_sessions || tls_sessions_imported) {
+		return;
+	}
+	tls_sessions_imported = 1;
+
+	for (i = 0; i < AUTH_WEB_TLS_SESSIONS; ++i) {
+		entry = &tls_sessions[i];
+		if (entry->sdata_len == 0 ||
+		    (entry->valid_until > 0 && entry->valid_until <= now) ||
+		    auth_web_lock(&entry->lock) < 0) {
+			continue;
+		}
+		curl_easy_ssls_import(handle, entry->key, entry->shmac,
+			entry->shmac_len, entry->sdata, entry->sdata_len);
+		auth_web_unlock(&entry->lock);
+	}
+#endif
+}
+
+static void
+auth_web_tls_export(CURL *handle)
+{
+#if LIBCURL_VERSION_NUM >= 0x080c00
+	if (tls_sessions) {
+		curl_easy_ssls_export(handle, auth_web_tls_export_cb, NULL);
+	}
+#endif
+}
+
+/* 64 bits even where long is 32, which would wrap after 35 minutes. */
+static int64_t
+auth_web_now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int
+auth_web_hist_index(int64_t value)
+{
+	unsigned int msb, shift;
+
+	if (value < (2 << AUTH_WEB_HIST_SUB_BITS)) {
+		return value < 0 ? 0 : (unsigned int) value;
+	}
+	if (value >= ((int64_t) 1 << 31)) {
+		return AUTH_WEB_HIST_BUCKETS - 1;
+	}
+
+	msb = 63 - __builtin_clzll((unsigned long long) value);
+	shift = msb - AUTH_WEB_HIST_SUB_BITS;
+	return (2 << AUTH_WEB_HIST_SUB_BITS) +
+		(msb - AUTH_WEB_HIST_SUB_BITS - 1) * (1 << AUTH_WEB_HIST_SUB_BITS) +
+		(unsigned int) ((value >> shift) - (1 << AUTH_WEB_HIST_SUB_BITS));
+}
+
+/* Returns the lowest value that falls into bucket i. */
+static int64_t
+auth_web_hist_value(unsigned int i)
+{
+	unsigned int level, sub;
+
+	if (i < (2 << AUTH_WEB_HIST_SUB_BITS)) {
+		return i;
+	}
+	level = (i - (2 << AUTH_WEB_HIST_SUB_BITS)) >> AUTH_WEB_HIST_SUB_BITS;
+	sub = (i - (2 << AUTH_WEB_HIST_SUB_BITS)) & ((1 << AUTH_WEB_HIST_SUB_BITS) - 1);
+	return (int64_t) ((1 << AUTH_WEB_HIST_SUB_BITS) + sub) << (level + 1);
+}
+
+static void
+auth_web_hist_record(struct auth_web_hist *hist, int64_t value)
+{
+	__sync_fetch_and_add(&hist->count[auth_web_hist_index(value)], 1);
+}
+
+/* Returns the value at quantile q (0 < q <= 1), and the number of values
+ * recorded in *total.
+ */
+static int64_t
+auth_web_hist_quantile(const struct auth_web_hist *hist, double q,
+                       uint64_t *total)
+{
+	uint64_t n = 0, seen = 0, rank;
+	register unsigned int i;
+
+	for (i = 0; i < AUTH_WEB_HIST_BUCKETS; ++i) {
+		n += hist->count[i];
+	}
+	*total = n;
+	if (n == 0) {
+		return 0;
+	}
+
+	rank = (uint64_t) (q * n + 0.5);
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (i = 0; i < AUTH_WEB_HIST_BUCKETS; ++i) {
+		seen += hist->count[i];
+		if (seen >= rank) {
+			break;
+		}
+	}
+	return auth_web_hist_value(i < AUTH_WEB_HIST_BUCKETS ? i : AUTH_WEB_HIST_BUCKETS - 1);
+}
+
+static void
+auth_web_timings_collect(CURL *handle, struct auth_web_timings *t)
+{
+	long connects = 0;
+#if LIBCURL_VERSION_NUM >= 0x073d00
+	curl_off_t v[AUTH_WEB_PHASES], bytes = 0;
+	static const CURLINFO info[AUTH_WEB_PHASES] = {
+		CURLINFO_NAMELOOKUP_TIME_T, CURLINFO_CONNECT_TIME_T,
+		CURLINFO_APPCONNECT_TIME_T, CURLINFO_STARTTRANSFER_TIME_T,
+		CURLINFO_TOTAL_TIME_T
+	};
+#else
+	double v[AUTH_WEB_PHASES], bytes = 0;
+	static const CURLINFO info[AUTH_WEB_PHASES] = {
+		CURLINFO_NAMELOOKUP_TIME, CURLINFO_CONNECT_TIME,
+		CURLINFO_APPCONNECT_TIME, CURLINFO_STARTTRANSFER_TIME,
+		CURLINFO_TOTAL_TIME
+	};
+#endif
+	register unsigned int i;
+
+	for (i = 0; i < AUTH_WEB_PHASES; ++i) {
+		v[i] = 0;
+		curl_easy_getinfo(handle, info[i], &v[i]);
+#if LIBCURL_VERSION_NUM >= 0x073d00
+		t->phase[i] = v[i];
+#else
+		t->phase[i] = (int64_t) (v[i] * 1000000);
+#endif
+	}
+#if LIBCURL_VERSION_NUM >= 0x073d00
+	curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+#else
+	curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD, &bytes);
+#endif
+	t->bytes = (int64_t) bytes;
+	curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &connects);
+	t->reused = connects == 0;
+}
+
+/* Records the time spent looking up the caches for one login. */
+static void
+auth_web_stats_cache_lookup(int64_t start)
+{
+	if (stats) {
+		auth_web_hist_record(&stats->cache_lookup, auth_web_now_usec() - start);
+	}
+}
+
+static void
+auth_web_stats_record(struct auth_web_backend *backend,
+                      const struct auth_web_timings *t)
+{
+	struct auth_web_backend_stats *bs;
+	register unsigned int i;
+
+	if (!stats || !backend) {
+		return;
+	}
+	bs = &stats->backends[backend - backends];
+	for (i = 0; i < AUTH_WEB_PHASES; ++i) {
+		auth_web_hist_record(&bs->phase[i], t->phase[i]);
+	}
+	__sync_fetch_and_add(&bs->requests, 1);
+	__sync_fetch_and_add(&bs->bytes, (uint64_t) t->bytes);
+	if (t->reused) {
+		__sync_fetch_and_add(&bs->reused, 1);
+	}
+}
+
+static struct auth_web_backend *
+auth_web_backend_find(const char *backend_url)
+{
+	unsigned long key = auth_web_hash(backend_url, 0);
+	register unsigned int i;
+
+	for (i = 0; backends && i < nbackends; ++i) {
+		if (backends[i].key == key) {
+			return &backends[i];
+		}
+	}
+	return NULL;
+}
+
+static long
+auth_web_backend_score(const struct auth_web_backend *backend)
+{
+	/* Latency in microseconds, inflated by up to 5x for a backend that
+	 * has been failing.
+	 */
+	return backend ? (backend->latency + 1) * (1000 + 4 * backend->errors) / 1000 : 1;
+}
+
+/* Returns 1 if the breaker lets a request through to backend. A breaker
+ * that has cooled down admits one probe at a time; with acquire set, this
+ * session claims the probe.
+ */
+static int
+auth_web_breaker_allow(struct auth_web_backend *backend, time_t now,
+                       int acquire)
+{
+	pid_t probe;
+
+	if (!backend || conf->breaker_failures == 0 ||
+	    backend->state == AUTH_WEB_BREAKER_CLOSED) {
+		return 1;
+	}
+	if (now < backend->opened + conf->breaker_cooldown) {
+		return 0;
+	}
+
+	/* A probe whose session died must not hold the breaker open. */
+	probe = backend->probe;
+	if (probe != 0 && (kill(probe, 0) == 0 || errno != ESRCH)) {
+		return 0;
+	}
+	if (!acquire) {
+		return 1;
+	}
+	return __sync_bool_compare_and_swap(&backend->probe, probe, getpid());
+}
+
+static void
+auth_web_breaker_update(struct auth_web_backend *backend, CURLcode res)
+{
+	time_t now = time(NULL);
+
+	if (!backend || conf->breaker_failures == 0) {
+		return;
+	}
+
+	if (res == CURLE_OK) {
+		backend->failures = 0;
+		if (backend->state == AUTH_WEB_BREAKER_OPEN) {
+			backend->state = AUTH_WEB_BREAKER_CLOSED;
+			pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": circuit breaker for %s closed", backend->url);
+		}
+
+	} else if (__sync_add_and_fetch(&backend->failures, 1) >= (unsigned int) conf->breaker_failures ||
+	           backend->state == AUTH_WEB_BREAKER_OPEN) {
+		if (backend->state != AUTH_WEB_BREAKER_OPEN) {
+			pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": circuit breaker for %s opened after %u consecutive failures", backend->url, backend->failures);
+			AUTH_WEB_COUNT(breaker_trips);
+		}
+		backend->opened = now;
+		backend->state = AUTH_WEB_BREAKER_OPEN;
+	}
+
+	__sync_bool_compare_and_swap(&backend->probe, getpid(), 0);
+}
+
+/* Picks an untried backend using the power of two choices: pick two at
+ * random and take the one with the better score. Backends that recently
+ * failed are only considered when nothing else is left, and backends whose
+ * circuit breaker is open are not considered at all.
+ */
+static int
+auth_web_backend_pick(pool *p, unsigned char *tried)
+{
+	struct auth_web_url *u = (struct auth_web_url *) conf->urls->elts;
+	unsigned int *candidates, ncandidates, a, b;
+	time_t now = time(NULL);
+	register unsigned int i;
+	int pass;
+
+	candidates = palloc(p, conf->urls->nelts * sizeof(unsigned int));
+	for (;;) {
+		ncandidates = 0;
+		for (pass = 0; pass < 2 && ncandidates == 0; ++pass) {
+			for (i = 0; i < conf->urls->nelts; ++i) {
+				if (tried[i] || !auth_web_breaker_allow(u[i].backend, now, FALSE)) {
+					continue;
+				}
+				if (pass == 0 && u[i].backend && u[i].backend->down_until > now) {
+					continue;
+				}
+				candidates[ncandidates++] = i;
+			}
+		}
+
+		if (ncandidates == 0) {
+			return -1;
+		}
+
+		a = candidates[0];
+		if (ncandidates > 1) {
+			a = rand_r(&backend_seed) % ncandidates;
+			b = (a + 1 + rand_r(&backend_seed) % (ncandidates - 1)) % ncandidates;
+			a = candidates[a];
+			b = candidates[b];
+			if (auth_web_backend_score(u[b].backend) < auth_web_backend_score(u[a].backend)) {
+				a = b;
+			}
+		}
+
+		/* Another session may have claimed the probe in the meantime. */
+		if (auth_web_breaker_allow(u[a].backend, now, TRUE)) {
+			return a;
+		}
+		tried[a] = 1;
+	}
+}
+
+static void
+auth_web_backend_update(struct auth_web_backend *backend, CURLcode res,
+                        int64_t elapsed)
+{
+	if (!backend) {
+		return;
+	}
+
+	/* Exponentially weighted moving averages, alpha = 1/8. errors is the
+	 * recent failure rate, in thousandths.
+	 */
+	if (res == CURLE_OK) {
+		backend->latency = backend->latency ?
+			backend->latency + (elapsed - backend->latency) / 8 : elapsed;
+		backend->errors -= backend->errors / 8;
+	} else {
+		backend->errors += (1000 - backend->errors) / 8;
+		backend->down_until = time(NULL) + conf->backend_retry;
+	}
+}
+
+/* Returns this process's easy handle, reset to its defaults, or NULL if
+ * one can't be created. A handle inherited across fork() is abandoned
+ * rather than cleaned up, since its connections belong to the parent.
+ */
+static CURL *
+auth_web_easy_handle(void)
+{
+	if (easy_handle && easy_handle_pid == getpid()) {
+		curl_easy_reset(easy_handle);
+		return easy_handle;
+	}
+
+	easy_multi = NULL;
+	easy_handle = curl_easy_init();
+	easy_handle_pid = getpid();
+	return easy_handle;
+}
+
+static void
+auth_web_easy_handle_free(void)
+{
+	if (easy_handle && easy_handle_pid == getpid()) {
+		curl_easy_cleanup(easy_handle);
+		if (easy_multi) {
+			curl_multi_cleanup(easy_multi);
+		}
+	}
+	easy_handle = NULL;
+	easy_multi = NULL;
+}
+
+/* Sends post_data to url, or a GET if post_data is NULL. */
+static CURLcode
+auth_web_perform(pool *p, const char *url, const char *post_data,
+                 struct curl_slist *headers, char *curl_error)
+{
+	CURL *curl_handle;
+	CURLcode success;
+
+	if (broker_pid > 0 && auth_web_broker_perform(p, url, post_data,
+	    headers, &success, curl_error) == 0) {
+		return success;
+	}
+
+	curl_handle = auth_web_easy_handle();
+	if (!curl_handle) {
+		sstrncpy(curl_error, "unable to create libcurl handle", CURL_ERROR_SIZE);
+		return CURLE_FAILED_INIT;
+	}
+	curl_easy_setopt(curl_handle, CURLOPT_URL, url);
+	curl_easy_setopt(curl_handle, CURLOPT_ERRORBUFFER, curl_error);
+	curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, get_response_headers);
+	curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, get_response_data);
+	curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
+	if (post_data) {
+		curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, post_data);
+	}
+	auth_web_set_timeouts(curl_handle, conf->connect_timeout, conf->total_timeout,
+		conf->low_speed_timeout);
+	auth_web_set_http_version(curl_handle, conf->http_version);
+	if (share) {
+		curl_easy_setopt(curl_handle, CURLOPT_SHARE, share);
+		auth_web_tls_import(curl_handle);
+	}
+	success = auth_web_multi_perform(curl_handle);
+	auth_web_timings_collect(curl_handle, &timings);
+	timings_valid = 1;
+	if (share && (success == CURLE_OK || response_decided)) {
+		auth_web_tls_export(curl_handle);
+	}
+	return success;
+}
+
+static size_t
+auth_web_warm_up_discard(char *buffer, size_t size, size_t nmemb, void *userp)
+{
+	return size * nmemb;
+}
+
+/* Returns the configuration of the main server, which warm-up requests
+ * use for their timeouts and HTTP version.
+ */
+static struct auth_web_conf *
+auth_web_warm_up_conf(void)
+{
+	struct auth_web_conf *sconf;
+
+	for (sconf = auth_web_confs; sconf; sconf = sconf->next) {
+		if (sconf->server == main_server) {
+			return sconf;
+		}
+	}
+	return NULL;
+}
+
+/* Adds a warm-up request for each backend to multi, and returns how many
+ * were added. Without a path, each AuthWebURL gets a HEAD request; with
+ * one, a GET for that path on the URL's host. direct is FALSE in the
+ * broker, whose connections stay open for later requests; the daemon
+ * closes its connections, which must not be inherited by sessions, and
+ * keeps only DNS and TLS sessions in the share.
+ */
+static unsigned int
+auth_web_warm_up_add(CURLM *multi, int direct)
+{
+	config_rec *c;
+	struct auth_web_conf *wconf;
+	const char *path = NULL;
+	char url[AUTH_WEB_BACKEND_URL_LEN * 2];
+	unsigned int n = 0;
+	register unsigned int i;
+
+	c = find_config(main_server->conf, CONF_PARAM, "AuthWebWarmUp", FALSE);
+	if (!c || !*((int *) c->argv[0])) {
+		return 0;
+	}
+	path = c->argv[1];
+	wconf = auth_web_warm_up_conf();
+
+	for (i = 0; i < nbackends; ++i) {
+		CURL *handle;
+		const char *host;
+		size_t len;
+
+		sstrncpy(url, backends[i].url, sizeof(url));
+		if (path) {
+			host = strstr(url, "://");
+			host = host ? host + 3 : url;
+			len = strcspn(host, "/?#");
+			sstrncpy(url + (host - url) + len, path,
+				sizeof(url) - (host - url) - len);
+		}
+
+		handle = curl_easy_init();
+		if (!handle) {
+			continue;
+		}
+		curl_easy_setopt(handle, CURLOPT_URL, url);
+		curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, auth_web_warm_up_discard);
+		if (!path) {
+			curl_easy_setopt(handle, CURLOPT_NOBODY, 1L);
+		}
+		auth_web_set_timeouts(handle,
+			wconf ? wconf->connect_timeout : AUTH_WEB_DEFAULT_CONNECT_TIMEOUT,
+			wconf ? wconf->total_timeout : AUTH_WEB_DEFAULT_TIMEOUT, 0);
+		if (wconf) {
+			auth_web_set_http_version(handle, wconf->http_version);
+		}
+		if (direct) {
+			curl_easy_setopt(handle, CURLOPT_FORBID_REUSE, 1L);
+			if (share) {
+				curl_easy_setopt(handle, CURLOPT_SHARE, share);
+				auth_web_tls_import(handle);
+			}
+		}
+
+		if (curl_multi_add_handle(multi, handle) != CURLM_OK) {
+			curl_easy_cleanup(handle);
+			continue;
+		}
+		++n;
+	}
+	return n;
+}
+
+static void
+auth_web_warm_up_done(CURLM *multi, CURL *handle, CURLcode res, int direct)
+{
+	char *url = NULL;
+	long status = 0;
+
+	curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &url);
+	curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &status);
+	if (res == CURLE_OK) {
+		pr_log_pri(PR_LOG_INFO, MOD_AUTH_WEB_VERSION ": warmed up %s (HTTP status %ld)", url ? url : "", status);
+		if (direct && share) {
+			auth_web_tls_export(handle);
+		}
+	} else {
+		pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": warm-up request to %s failed: %s", url ? url : "", curl_easy_strerror(res));
+	}
+
+	curl_multi_remove_handle(multi, handle);
+	curl_easy_cleanup(handle);
+}
+
+/* Sends the warm-up requests from the daemon when there is no broker, so
+ * that sessions find DNS answers, and TLS sessions when
+ * AuthWebTLSSessionCache is on, already cached.
+ */
+static void
+auth_web_warm_up(void)
+{
+	CURLM *multi;
+	CURLMsg *msg;
+	int running, left;
+
+	/* Under inetd, this would delay every connection. */
+	if (broker_pid > 0 || ServerType == SERVER_INETD) {
+		return;
+	}
+	multi = curl_multi_init();
+	if (!multi) {
+		return;
+	}
+
+	running = auth_web_warm_up_add(multi, TRUE) > 0;
+	while (running) {
+		if (curl_multi_perform(multi, &running) != CURLM_OK) {
+			break;
+		}
+		while ((msg = curl_multi_info_read(multi, &left))) {
+			if (msg->msg == CURLMSG_DONE) {
+				auth_web_warm_up_done(multi, msg->easy_handle, msg->data.result, TRUE);
+			}
+		}
+		if (running) {
+			curl_multi_wait(multi, NULL, 0, 1000, NULL);
+		}
+	}
+	curl_multi_cleanup(multi);
+}
+
+/* Waits for the broker to close the other end of fd, which it does once
+ * its warm-up requests have finished.
+ */
+static void
+auth_web_warm_up_wait(int fd)
+{
+	struct auth_web_conf *wconf = auth_web_warm_up_conf();
+	struct pollfd pfd;
+	int64_t deadline;
+	char c;
+	int res;
+
+	deadline = auth_web_now_usec() + (int64_t) 1000000 * (AUTH_WEB_WARM_UP_GRACE +
+		(wconf ? wconf->total_timeout : AUTH_WEB_DEFAULT_TIMEOUT));
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		int64_t now = auth_web_now_usec();
+
+		if (now >= deadline) {
+			pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": broker warm-up did not finish in time");
+			return;
+		}
+		res = poll(&pfd, 1, (int) ((deadline - now) / 1000) + 1);
+		if (res < 0 && errno == EINTR) {
+			continue;
+		}
+		if (res > 0 && read(fd, &c, 1) > 0) {
+			continue;
+		}
+		return;
+	}
+}
+
+static void
+auth_web_futex_wait(volatile int *word, int value)
+{
+#ifdef __linux__
+	struct timespec ts = { 1, 0 };
+
+	syscall(SYS_futex, word, FUTEX_WAIT, value, &ts, NULL, 0);
+#else
+	if (*word == value) {
+		usleep(10000);
+	}
+#endif
+}
+
+static void
+auth_web_futex_wake(volatile int *word)
+{
+#ifdef __linux__
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* Takes a token from backend's bucket, waiting until deadline (in
+ * microseconds) at most. Returns 0 on success and -1 on timeout.
+ */
+static int
+auth_web_backend_take_token(struct auth_web_backend *backend, int64_t deadline)
+{
+	int64_t now, wait, cap = (int64_t) conf->rate_burst * 1000;
+
+	for (;;) {
+		if (auth_web_lock(&backend->lock) < 0) {
+			return -1;
+		}
+		now = auth_web_now_usec();
+		if (backend->refilled == 0) {
+			backend->tokens = cap;
+		} else {
+			backend->tokens += (now - backend->refilled) * conf->rate_limit / 1000;
+			if (backend->tokens > cap) {
+				backend->tokens = cap;
+			}
+		}
+		backend->refilled = now;
+
+		if (backend->tokens >= 1000) {
+			backend->tokens -= 1000;
+			auth_web_unlock(&backend->lock);
+			return 0;
+		}
+		wait = (1000 - backend->tokens) * 1000 / conf->rate_limit + 1;
+		auth_web_unlock(&backend->lock);
+
+		if (now + wait > deadline) {
+			return -1;
+		}
+		usleep(wait < 100000 ? wait : 100000);
+		pr_signals_handle();
+	}
+}
+
+/* Claims one of backend's AuthWebMaxConcurrent request slots, waiting
+ * until deadline at most. Returns the slot, or -1 on timeout.
+ */
+static int
+auth_web_backend_take_slot(struct auth_web_backend *backend, int64_t deadline)
+{
+	pid_t self = getpid(), owner;
+	int released, max = conf->max_concurrent;
+	register int i;
+
+	for (;;) {
+		released = backend->released;
+		for (i = 0; i < max; ++i) {
+			owner = backend->slots[i];
+			if ((owner == 0 || (kill(owner, 0) < 0 && errno == ESRCH)) &&
+			    __sync_bool_compare_and_swap(&backend->slots[i], owner, self)) {
+				return i;
+			}
+		}
+
+		if (auth_web_now_usec() >= deadline) {
+			return -1;
+		}
+		auth_web_futex_wait(&backend->released, released);
+		pr_signals_handle();
+	}
+}
+
+/* Waits, for up to AuthWebQueueTimeout seconds, until backend's limits
+ * allow another request. Returns the request slot taken (or AUTH_WEB_BACKEND_MAX_SLOTS
+ * if there is no concurrency limit), or -1 if the wait timed out.
+ */
+static int
+auth_web_backend_acquire(struct auth_web_backend *backend)
+{
+	int64_t deadline;
+
+	if (!backend || (conf->max_concurrent == 0 && conf->rate_limit == 0)) {
+		return AUTH_WEB_BACKEND_MAX_SLOTS;
+	}
+
+	deadline = auth_web_now_usec() + (int64_t) conf->queue_timeout * 1000000;
+	if (conf->rate_limit > 0 &&
+	    auth_web_backend_take_token(backend, deadline) < 0) {
+		return -1;
+	}
+	if (conf->max_concurrent > 0) {
+		return auth_web_backend_take_slot(backend, deadline);
+	}
+	return AUTH_WEB_BACKEND_MAX_SLOTS;
+}
+
+static void
+auth_web_backend_release(struct auth_web_backend *backend, int slot)
+{
+	if (!backend || slot >= AUTH_WEB_BACKEND_MAX_SLOTS) {
+		return;
+	}
+	backend->slots[slot] = 0;
+	__sync_add_and_fetch(&backend->released, 1);
+	auth_web_futex_wake(&backend->released);
+}
+
+/* Returns the session cookies set by the last response, as the value of a
+ * Cookie header, or NULL if there were none.
+ */
+static char *
+auth_web_cookie_collect(pool *p)
+{
+	char *value = NULL, *str, *end;
+	register unsigned int i;
+
+	for (i = 0; received_headers && i < received_headers->nelts; ++i) {
+		str = ((char **) received_headers->elts)[i];
+		if (strncmp(str, "HTTP/", 5) == 0) {
+			/* Only the last response's cookies count. */
+			value = NULL;
+			continue;
+		}
+		if (strncasecmp(str, "Set-Cookie:", 11) != 0) {
+			continue;
+		}
+		for (str += 11; *str == ' ' || *str == '\t'; ++str);
+		end = strchr(str, ';');
+		str = end ? pstrndup(p, str, end - str) : str;
+		value = value ? pstrcat(p, value, "; ", str, NULL) : pstrdup(p, str);
+	}
+	return value;
+}
+
+#ifdef PR_USE_OPENSSL
+static int
+auth_web_cookie_key(pool *p, const char *username, const char *password,
+                    unsigned char *key)
+{
+	size_t user_len = strlen(username), pass_len = strlen(password);
+	unsigned int key_len = AUTH_WEB_COOKIE_KEY_LEN;
+	unsigned char *msg;
+	int res;
+
+	msg = palloc(p, user_len + 1 + pass_len);
+	memcpy(msg, username, user_len + 1);
+	memcpy(msg + user_len + 1, password, pass_len);
+	res = HMAC(EVP_sha256(), cookie_secret, sizeof(cookie_secret), msg,
+		user_len + 1 + pass_len, key, &key_len) ? 0 : -1;
+	pr_memscrub(msg, user_len + 1 + pass_len);
+	return res;
+}
+
+/* Returns the pointer to the cookie slot of username's entry with hash,
+ * locked, or NULL.
+ */
+static struct auth_web_cookie *
+auth_web_cookie_slot(const char *username, const char *hash,
+                     struct auth_web_cache_entry **locked)
+{
+	struct auth_web_cache_entry *entry;
+	unsigned long key = auth_web_cache_key(username);
+	register unsigned int i;
+
+	for (i = 0; i < cache->probes; ++i) {
+		entry = &cache->entries[(key + i) % cache->size];
+		if (entry->key != key || auth_web_lock(&entry->lock) < 0) {
+			continue;
+		}
+		if (entry->key == key && entry->sid == main_server->sid &&
+		    strcmp(entry->user, username) == 0 &&
+		    strcmp(entry->hash, hash) == 0) {
+			*locked = entry;
+			return &cookies[entry - cache->entries];
+		}
+		auth_web_unlock(&entry->lock);
+	}
+	return NULL;
+}
+#endif
+
+static void
+auth_web_cookie_save(pool *p, const char *username, const char *password,
+                     const char *hash, const char *value)
+{
+#ifdef PR_USE_OPENSSL
+	struct auth_web_cookie cookie, *slot;
+	struct auth_web_cache_entry *entry;
+	unsigned char key[AUTH_WEB_COOKIE_KEY_LEN];
+	EVP_CIPHER_CTX *ctx;
+	int len, final_len, ok = 0;
+
+	if (!value || strlen(value) > AUTH_WEB_COOKIE_LEN ||
+	    auth_web_cookie_key(p, username, password, key) < 0 ||
+	    RAND_bytes(cookie.iv, sizeof(cookie.iv)) != 1) {
+		return;
+	}
+
+	ctx = EVP_CIPHER_CTX_new();
+	if (ctx &&
+	    EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, cookie.iv) == 1 &&
+	    EVP_EncryptUpdate(ctx, cookie.data, &len, (const unsigned char *) value, strlen(value)) == 1 &&
+	    EVP_EncryptFinal_ex(ctx, cookie.data + len, &final_len) == 1 &&
+	    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, sizeof(cookie.tag), cookie.tag) == 1) {
+		ok = 1;
+	}
+	EVP_CIPHER_CTX_free(ctx);
+	pr_memscrub(key, sizeof(key));
+	if (!ok) {
+		return;
+	}
+	cookie.len = len + final_len;
+	cookie.expires = time(NULL) + conf->cookie_ttl;
+
+	slot = auth_web_cookie_slot(username, hash, &entry);
+	if (slot) {
+		memcpy(slot, &cookie, sizeof(cookie));
+		auth_web_unlock(&entry->lock);
+	}
+#endif
+}
+
+/* Returns the saved cookies for username's previous login with hash, if
+ * they haven't expired, or NULL.
+ */
+static char *
+auth_web_cookie_find(pool *p, const char *username, const char *password,
+                     const char *hash)
+{
+#ifdef PR_USE_OPENSSL
+	struct auth_web_cookie cookie, *slot;
+	struct auth_web_cache_entry *entry;
+	unsigned char key[AUTH_WEB_COOKIE_KEY_LEN];
+	EVP_CIPHER_CTX *ctx;
+	char *value;
+	int len, final_len, ok = 0;
+
+	slot = auth_web_cookie_slot(username, hash, &entry);
+	if (!slot) {
+		return NULL;
+	}
+	memcpy(&cookie, slot, sizeof(cookie));
+	auth_web_unlock(&entry->lock);
+
+	if (cookie.len == 0 || cookie.expires <= time(NULL) ||
+	    auth_web_cookie_key(p, username, password, key) < 0) {
+		return NULL;
+	}
+
+	value = palloc(p, cookie.len + 1);
+	ctx = EVP_CIPHER_CTX_new();
+	if (ctx &&
+	    EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, cookie.iv) == 1 &&
+	    EVP_DecryptUpdate(ctx, (unsigned char *) value, &len, cookie.data, cookie.len) == 1 &&
+	    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, sizeof(cookie.tag), cookie.tag) == 1 &&
+	    EVP_DecryptFinal_ex(ctx, (unsigned char *) value + len, &final_len) == 1) {
+		ok = 1;
+	}
+	EVP_CIPHER_CTX_free(ctx);
+	pr_memscrub(key, sizeof(key));
+	if (!ok) {
+		return NULL;
+	}
+	value[len + final_len] = 0;
+	return value;
+#else
+	return NULL;
+#endif
+}
+
+/* Applies AuthWebLoginFailedString, AuthWebRequireHeader and AuthWebRule
+ * to the response just received. Returns 0 if they all accept it.
+ */
+static int
+auth_web_response_check(pool *p)
+{
+	if (failed_string_found) {
+		pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": found failed string '%s' in response", conf->failed_string);
+		return -1;
+	}
+
+	if (conf->required_headers != NULL) {
+		register unsigned int i, j;
+		int found;
+		unsigned int nreceived = received_headers ? received_headers->nelts : 0;
+		char **required = (char **) conf->required_headers->elts,
+		     **received = received_headers ? (char **) received_headers->elts : NULL;
+
+		for (i = 0; i < conf->required_headers->nelts; ++i) {
+			pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": checking for header '%s' in response", required[i]);
+			found = 0;
+
+			for (j = 0; j < nreceived; ++j) {
+				if (strcmp(required[i], received[j]) == 0) {
+					found = 1;
+					break;
+				}
+			}
+
+			if (!found) {
+				pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": couldn't find header '%s' in response", required[i]);
+				return -1;
+			}
+		}
+	}
+
+	if (conf->rules != NULL) {
+		struct auth_web_rule *failed;
+		int64_t start;
+
+		start = auth_web_now_usec();
+		failed = auth_web_rules_finish(p);
+		rules_usec += auth_web_now_usec() - start;
+		if (stats) {
+			auth_web_hist_record(&stats->rules, rules_usec);
+		}
+
+		if (failed) {
+			pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": response failed rule '%s'", failed->text);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Confirms a login by sending its saved cookies to AuthWebValidateURL; a
+ * 2xx response that passes the same checks as a password login means the
+ * upstream still considers the session valid. On success the cache entry
+ * is renewed, with any cookies the response replaced.
+ */
+static int
+auth_web_cookie_validate(pool *p, const char *username, const char *password,
+                         const char *hash, const char *value)
+{
+	struct curl_slist *headers = NULL, *header;
+	char curl_error[CURL_ERROR_SIZE], *renewed;
+	CURLcode res;
+
+	for (header = conf->static_headers; header; header = header->next) {
+		headers = curl_slist_append(headers, header->data);
+	}
+	headers = curl_slist_append(headers, pstrcat(p, "Cookie: ", value, NULL));
+
+	auth_web_response_reset();
+	curl_error[0] = 0;
+	pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": validating saved session for user %s at %s", username, conf->validate_url);
+	res = auth_web_perform(p, conf->validate_url, NULL, headers, curl_error);
+	curl_slist_free_all(headers);
+	if (res == CURLE_WRITE_ERROR && response_decided) {
+		res = CURLE_OK;
+	}
+
+	if (res != CURLE_OK) {
+		pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": URL call to %s failed: %s", conf->validate_url, curl_error);
+		auth_web_response_free();
+		return -1;
+	}
+	if (response_too_large) {
+		auth_web_response_free();
+		pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": saved session for user %s not checked, response too large", username);
+		return -1;
+	}
+	if (response_status / 100 != 2) {
+		auth_web_response_free();
+		pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": saved session for user %s rejected with HTTP status %d", username, response_status);
+		return -1;
+	}
+	if (auth_web_response_check(p) < 0) {
+		auth_web_response_free();
+		pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": saved session for user %s rejected", username);
+		return -1;
+	}
+
+	renewed = auth_web_cookie_collect(p);
+	auth_web_response_free();
+	auth_web_cache_store(cache, username, hash, conf->cache_ttl);
+	auth_web_cookie_save(p, username, password, hash, renewed ? renewed : value);
+	return 0;
+}
+
+/* Returns TRUE if res means that a URL couldn't be reached or didn't answer
+ * in time, rather than that it answered with something unusable.
+ */
+static int
+auth_web_curl_unreachable(CURLcode res)
+{
+	switch (res) {
+	case CURLE_COULDNT_RESOLVE_PROXY:
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_OPERATION_TIMEDOUT:
+	case CURLE_SSL_CONNECT_ERROR:
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_GOT_NOTHING:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static int
+auth_web_login_send(pool *p, const char *username, const char *password,
+                    const char *client_addr, const char *cache_hash)
+{
+	char *post_data, curl_error[CURL_ERROR_SIZE];
+	unsigned char *tried;
+	struct auth_web_url *backend_url;
+	CURLcode success = CURLE_FAILED_INIT;
+	int64_t start;
+	int which, slot, limited = FALSE, unreachable = TRUE;
+
+	post_data = auth_web_body_build(username, password);
+	if (!post_data) {
+		return AUTH_WEB_LOGIN_DECLINED;
+	}
+	if (conf->header_tmpls && auth_web_headers_build(username, password) < 0) {
+		pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": credentials for user %s can't be sent in a header, declining", username);
+		auth_web_body_wipe();
+		return AUTH_WEB_LOGIN_DECLINED;
+	}
+
+	/* Fail over to the next backend until one answers. */
+	tried = pcalloc(p, conf->urls->nelts);
+	while ((which = auth_web_backend_pick(p, tried)) >= 0) {
+		tried[which] = 1;
+		backend_url = &((struct auth_web_url *) conf->urls->elts)[which];
+		auth_web_response_reset();
+		curl_error[0] = 0;
+		timings_valid = 0;
+
+		slot = auth_web_backend_acquire(backend_url->backend);
+		if (slot < 0) {
+			pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": URL %s is at its request limit, skipping", backend_url->url);
+			/* Don't leave the circuit breaker probe claimed. */
+			__sync_bool_compare_and_swap(&backend_url->backend->probe, getpid(), 0);
+			limited = TRUE;
+			continue;
+		}
+
+		pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": calling URL %s for user %s", backend_url->url, username);
+		start = auth_web_now_usec();
+		if (conf->method == AUTH_WEB_METHOD_GET) {
+			success = auth_web_perform(p, auth_web_body_url(backend_url->url,
+				post_data), NULL, conf->headers, curl_error);
+		} else {
+			success = auth_web_perform(p, backend_url->url, post_data,
+				conf->headers, curl_error);
+		}
+		auth_web_backend_release(backend_url->backend, slot);
+		if (timings_valid) {
+			auth_web_stats_record(backend_url->backend, &timings);
+		}
+		/* A response cut short once its verdict was known, or for going
+		 * over a limit, still shows the URL answering.
+		 */
+		if (success == CURLE_WRITE_ERROR && response_decided) {
+			success = CURLE_OK;
+		}
+		auth_web_backend_update(backend_url->backend, success,
+			auth_web_now_usec() - start);
+		auth_web_breaker_update(backend_url->backend, success);
+		if (success == CURLE_OK) {
+			break;
+		}
+		if (!auth_web_curl_unreachable(success)) {
+			unreachable = FALSE;
+		}
+		AUTH_WEB_COUNT(curl_errors[success < AUTH_WEB_CURL_CODES ?
+			success : AUTH_WEB_CURL_CODES - 1]);
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": URL call to %s failed: %s",
+			backend_url->url, curl_error);
+	}
+	auth_web_body_wipe();
+
+	if (success == CURLE_OK) {
+		pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": URL call succeeded");
+	} else {
+		if (which < 0 && success == CURLE_FAILED_INIT) {
+			pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": no URL available for user %s, declining", username);
+		}
+		/* Every URL was skipped for its circuit breaker or failed to answer,
+		 * unless one was held back by a local request limit.
+		 */
+		return unreachable && !limited ? AUTH_WEB_LOGIN_UNAVAILABLE :
+			AUTH_WEB_LOGIN_DECLINED;
+	}
+	if (response_too_large) {
+		pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": response for user %s is too large, declining", username);
+		return AUTH_WEB_LOGIN_DECLINED;
+	}
+
+	if (auth_web_response_check(p) < 0) {
+		if (client_addr) {
+			auth_web_cache_store(neg_cache, username, client_addr, conf->neg_cache_ttl);
+		}
+		return AUTH_WEB_LOGIN_REJECTED;
+	}
+
+	if (cache_hash) {
+		auth_web_cache_store(cache, username, cache_hash, conf->cache_ttl);
+		if (cookies && conf->validate_url) {
+			auth_web_cookie_save(p, username, password, cache_hash,
+				auth_web_cookie_collect(p));
+		}
+	}
+
+	return AUTH_WEB_LOGIN_OK;
+}
+
+/* Sends a login to AuthWebURL, and records the outcome in the caches.
+ * Returns one of the AUTH_WEB_LOGIN_ values. Whatever the response
+ * allocated is released as soon as the verdict is known.
+ */
+static int
+auth_web_login(pool *p, const char *username, const char *password,
+               const char *client_addr, const char *cache_hash)
+{
+	int res = auth_web_login_send(p, username, password, client_addr,
+		cache_hash);
+
+	auth_web_response_free();
+	if (offline) {
+		if (res == AUTH_WEB_LOGIN_OK) {
+			auth_web_offline_store(p, username, password, cache_hash);
+		} else if (res == AUTH_WEB_LOGIN_REJECTED) {
+			auth_web_offline_forget(p, username, password, cache_hash);
+		}
+	}
+	return res;
+}
+
+
+static int
+auth_web_flight_alive(const struct auth_web_flight *flight)
+{
+	return kill(flight->leader, 0) == 0 || errno != ESRCH;
+}
+
+static int
+auth_web_flight_match(const struct auth_web_flight *flight, unsigned long key,
+                      const char *username, const char *hash)
+{
+	return flight->key == key && flight->conf == conf &&
+		strcmp(flight->user, username) == 0 && strcmp(flight->hash, hash) == 0;
+}
+
+/* Finds the in-flight request for this login, returning it with *leader
+ * set to 0 and the slot's current sequence number in *seq, or else claims
+ * a slot for it, with *leader set to 1. Returns NULL if no slot is free.
+ */
+static struct auth_web_flight *
+auth_web_flight_join(const char *username, const char *hash, int *leader,
+                     int *seq)
+{
+	struct auth_web_flight *flight, *claim = NULL;
+	unsigned long key;
+	register unsigned int i;
+
+	if (strlen(username) >= AUTH_WEB_CACHE_USER_LEN ||
+	    strlen(hash) >= AUTH_WEB_CACHE_HASH_LEN ||
+	    auth_web_lock(&flights->lock) < 0) {
+		return NULL;
+	}
+
+	key = auth_web_hash(hash, auth_web_hash(username, 0));
+	for (i = 0; i < AUTH_WEB_FLIGHT_PROBES; ++i) {
+		flight = &flights->slots[(key + i) % AUTH_WEB_FLIGHT_SLOTS];
+
+		if (flight->state == AUTH_WEB_FLIGHT_BUSY && auth_web_flight_alive(flight)) {
+			if (auth_web_flight_match(flight, key, username, hash)) {
+				*leader = 0;
+				*seq = flight->seq;
+				auth_web_unlock(&flights->lock);
+				return flight;
+			}
+		} else if (!claim) {
+			claim = flight;
+		}
+	}
+
+	if (claim) {
+		claim->state = AUTH_WEB_FLIGHT_BUSY;
+		claim->leader = getpid();
+		claim->key = key;
+		claim->conf = conf;
+		sstrncpy(claim->user, username, sizeof(claim->user));
+		sstrncpy(claim->hash, hash, sizeof(claim->hash));
+		*leader = 1;
+	}
+	auth_web_unlock(&flights->lock);
+	return claim;
+}
+
+static void
+auth_web_flight_publish(struct auth_web_flight *flight, int result)
+{
+	if (auth_web_lock(&flights->lock) < 0) {
+		/* Waiters will give up when they see this process has gone. */
+		return;
+	}
+	flight->result = result;
+	flight->state = AUTH_WEB_FLIGHT_DONE;
+	__sync_add_and_fetch(&flight->seq, 1);
+	auth_web_unlock(&flights->lock);
+	auth_web_futex_wake(&flight->seq);
+}
+
+/* Waits up to conf->coalesce seconds for the leader of flight to publish
+ * a result, then returns it, or -1 if none arrived.
+ */
+static int
+auth_web_flight_wait(struct auth_web_flight *flight, int seq,
+                     const char *username, const char *hash)
+{
+	time_t deadline = time(NULL) + conf->coalesce;
+	unsigned long key = auth_web_hash(hash, auth_web_hash(username, 0));
+	int result = -1;
+
+	while (flight->seq == seq) {
+		if (time(NULL) >= deadline || !auth_web_flight_alive(flight)) {
+			return -1;
+		}
+		auth_web_futex_wait(&flight->seq, seq);
+		pr_signals_handle();
+	}
+
+	if (auth_web_lock(&flights->lock) < 0) {
+		return -1;
+	}
+	if (flight->seq == seq + 1 &&
+	    auth_web_flight_match(flight, key, username, hash)) {
+		result = flight->result;
+	}
+	auth_web_unlock(&flights->lock);
+	return result;
+}
+
+/* Revalidates a cached login in a helper, detached from the session by a
+ * double fork so that it can't delay the login or become a zombie. The
+ * helper refreshes the entry on success, and drops it if AuthWebURL now
+ * rejects the password.
+ */
+static void
+auth_web_cache_refresh(const char *username, const char *password,
+                       const char *cache_hash)
+{
+	pool *p;
+	pid_t pid;
+	int res;
+
+	pid = fork();
+	if (pid < 0) {
+		pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": unable to fork cache refresh helper: %s", strerror(errno));
+		auth_web_cache_refreshing(cache, username, 0);
+		return;
+	}
+
+	if (pid > 0) {
+		while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+		return;
+	}
+
+	if (fork() != 0) {
+		_exit(0);
+	}
+
+	/* The helper must never touch the client's connection. */
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGALRM, SIG_DFL);
+	if (session.c) {
+		close(session.c->rfd);
+		if (session.c->wfd != session.c->rfd) {
+			close(session.c->wfd);
+		}
+	}
+
+	auth_web_cache_refreshing(cache, username, getpid());
+	p = make_sub_pool(session.pool);
+	res = auth_web_login(p, username, password, NULL, cache_hash);
+	if (res == AUTH_WEB_LOGIN_REJECTED) {
+		pr_log_pri(PR_LOG_INFO, MOD_AUTH_WEB_VERSION ": cached login for user %s no longer valid, dropping it", username);
+		auth_web_cache_forget(cache, username);
+	} else if (res != AUTH_WEB_LOGIN_OK) {
+		auth_web_cache_refreshing(cache, username, 0);
+	}
+	_exit(0);
+}
+
+MODRET
+handle_auth_web_auth(cmd_rec *cmd)
+{
+	const char *username = cmd->argv[0];
+	const char *password = cmd->argv[1];
+	const char *client_addr = NULL;
+	char *cache_hash = NULL;
+	struct auth_web_flight *flight = NULL;
+	int leader = 0, seq = 0, result = -1, hit;
+	int64_t start = auth_web_now_usec();
+
+	conf = auth_web_route(cmd->argv[0]);
+	if (!conf) {
+		return PR_DECLINED(cmd);
+	}
+	if (!auth_web_user_allowed(cmd->tmp_pool, cmd->argv[0])) {
+		pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": user doesn't match AuthWebUserRegex or AuthWebUserSuffix");
+		return PR_DECLINED(cmd);
+	}
+	AUTH_WEB_COUNT(attempts);
+
+	if (neg_cache && conf->neg_cache_ttl > 0) {
+		client_addr = pr_netaddr_get_ipstr(session.c->remote_addr);
+		if (auth_web_cache_lookup(neg_cache, username, client_addr, 0)) {
+			auth_web_stats_cache_lookup(start);
+			AUTH_WEB_COUNT(rejections);
+			pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": rejecting user %s from %s after recent failed login", username, client_addr);
+			return PR_ERROR_INT(cmd, PR_AUTH_BADPWD);
+		}
+	}
+
+	if (cache && conf->cache_ttl > 0) {
+		cache_hash = auth_web_cache_hash(cmd->tmp_pool, cache->salt, username, password);
+		hit = cache_hash ? auth_web_cache_lookup(cache, username, cache_hash,
+			conf->cache_soft_ttl) : AUTH_WEB_CACHE_MISS;
+		auth_web_stats_cache_lookup(start);
+		if (hit != AUTH_WEB_CACHE_MISS) {
+			pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": using cached successful login for user %s", username);
+			if (hit == AUTH_WEB_CACHE_STALE) {
+				auth_web_cache_refresh(username, password, cache_hash);
+			}
+			AUTH_WEB_COUNT(successes);
+			session.auth_mech = "mod_auth_web.c";
+			return PR_HANDLED(cmd);
+		}
+
+		if (cookies && conf->validate_url && cache_hash) {
+			const char *saved = auth_web_cookie_find(cmd->tmp_pool, username,
+				password, cache_hash);
+
+			if (saved && auth_web_cookie_validate(cmd->tmp_pool, username,
+			    password, cache_hash, saved) == 0) {
+				pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": saved session for user %s still valid", username);
+				AUTH_WEB_COUNT(successes);
+				session.auth_mech = "mod_auth_web.c";
+				return PR_HANDLED(cmd);
+			}
+		}
+	}
+
+	if (flights && conf->coalesce > 0) {
+		const char *flight_hash = cache_hash ? cache_hash :
+			auth_web_cache_hash(cmd->tmp_pool, flights->salt, username, password);
+
+		if (flight_hash) {
+			flight = auth_web_flight_join(username, flight_hash, &leader, &seq);
+		}
+		if (flight && !leader) {
+			AUTH_WEB_COUNT(coalesced);
+			pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": waiting for identical login for user %s in process %d", username, (int) flight->leader);
+			result = auth_web_flight_wait(flight, seq, username, flight_hash);
+			if (result < 0) {
+				pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": no result from process %d, sending own request", (int) flight->leader);
+			}
+		}
+	}
+
+	if (result < 0) {
+		result = auth_web_login(cmd->tmp_pool, username, password, client_addr,
+			cache_hash);
+		if (flight && leader) {
+			auth_web_flight_publish(flight, result);
+		}
+	}
+
+	switch (result) {
+	case AUTH_WEB_LOGIN_OK:
+		AUTH_WEB_COUNT(successes);
+		session.auth_mech = "mod_auth_web.c";
+		return PR_HANDLED(cmd);
+
+	case AUTH_WEB_LOGIN_REJECTED:
+		AUTH_WEB_COUNT(rejections);
+		return PR_ERROR_INT(cmd, PR_AUTH_BADPWD);
+	}
+
+	/* No URL could be reached. */
+	if (result == AUTH_WEB_LOGIN_UNAVAILABLE && offline &&
+	    auth_web_offline_verify(cmd->tmp_pool, username, password) == 0) {
+		pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": no answer from any URL, verified user %s with offline store", username);
+		AUTH_WEB_COUNT(offline_logins);
+		AUTH_WEB_COUNT(successes);
+		session.auth_mech = "mod_auth_web.c";
+		return PR_HANDLED(cmd);
+	}
+	AUTH_WEB_COUNT(declines);
+	return PR_DECLINED(cmd);
+}
+
+MODRET
+set_config_value(cmd_rec *cmd)
+{
+	CHECK_ARGS(cmd, 1);
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+	add_config_param_str(cmd->argv[0], 1, cmd->argv[1]);
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_url(cmd_rec *cmd)
+{
+	config_rec *c;
+	register int i;
+
+	if (cmd->argc < 2) {
+		CONF_ERROR(cmd, "missing parameters");
+	}
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+	c = add_config_param(cmd->argv[0], 0);
+	c->argc = cmd->argc - 1;
+	c->argv = pcalloc(c->pool, cmd->argc * sizeof(void *));
+	for (i = 1; i < cmd->argc; ++i) {
+		c->argv[i - 1] = pstrdup(c->pool, cmd->argv[i]);
+	}
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_max_concurrent(cmd_rec *cmd)
+{
+	config_rec *c;
+	char *endp;
+	long max;
+
+	CHECK_ARGS(cmd, 1);
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+	max = strtol(cmd->argv[1], &endp, 10);
+	if (*endp || max < 0 || max > AUTH_WEB_BACKEND_MAX_SLOTS) {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": '", cmd->argv[1], "' is not a valid number of requests", NULL));
+	}
+
+	c = add_config_param(cmd->argv[0], 1, NULL);
+	c->argv[0] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[0]) = (int) max;
+	return PR_HANDLED(cmd);
+}
+
+/* usage: AuthWebRateLimit requests-per-second [burst] */
+MODRET
+set_rate_limit(cmd_rec *cmd)
+{
+	config_rec *c;
+	char *endp;
+	long rate, burst;
+
+	if (cmd->argc < 2 || cmd->argc > 3) {
+		CONF_ERROR(cmd, "wrong number of parameters");
+	}
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+	rate = strtol(cmd->argv[1], &endp, 10);
+	if (*endp || rate < 0 || rate > 1000000) {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": '", cmd->argv[1], "' is not a valid rate", NULL));
+	}
+	burst = rate > 0 ? rate : 1;
+	if (cmd->argc == 3) {
+		burst = strtol(cmd->argv[2], &endp, 10);
+		if (*endp || burst < 1 || burst > 1000000) {
+			CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": '", cmd->argv[2], "' is not a valid burst", NULL));
+		}
+	}
+
+	c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+	c->argv[0] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[0]) = (int) rate;
+	c->argv[1] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[1]) = (int) burst;
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_circuit_breaker(cmd_rec *cmd)
+{
+	config_rec *c;
+	char *endp;
+	long failures, cooldown;
+
+	CHECK_ARGS(cmd, 2);
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+	failures = strtol(cmd->argv[1], &endp, 10);
+	if (*endp || failures < 0 || failures > INT_MAX) {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": '", cmd->argv[1], "' is not a valid number of failures", NULL));
+	}
+	cooldown = strtol(cmd->argv[2], &endp, 10);
+	if (*endp || cooldown < 1 || cooldown > INT_MAX) {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": '", cmd->argv[2], "' is not a valid number of seconds", NULL));
+	}
+
+	c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+	c->argv[0] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[0]) = (int) failures;
+	c->argv[1] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[1]) = (int) cooldown;
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_config_number(cmd_rec *cmd)
+{
+	config_rec *c;
+	char *endp;
+	long value;
+
+	CHECK_ARGS(cmd, 1);
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+	value = strtol(cmd->argv[1], &endp, 10);
+	if (*((char *) cmd->argv[1]) == 0 || *endp || value < 0 || value > INT_MAX) {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": '", cmd->argv[1], "' is not a valid number", NULL));
+	}
+
+	c = add_config_param(cmd->argv[0], 1, NULL);
+	c->argv[0] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[0]) = (int) value;
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_cache_size(cmd_rec *cmd)
+{
+	CHECK_CONF(cmd, CONF_ROOT);
+	return set_config_number(cmd);
+}
+
+MODRET
+set_cache_eviction(cmd_rec *cmd)
+{
+	config_rec *c;
+	int eviction;
+
+	CHECK_ARGS(cmd, 1);
+	CHECK_CONF(cmd, CONF_ROOT);
+
+	if (strcasecmp(cmd->argv[1], "lru") == 0) {
+		eviction = AUTH_WEB_CACHE_EVICT_LRU;
+	} else if (strcasecmp(cmd->argv[1], "fifo") == 0) {
+		eviction = AUTH_WEB_CACHE_EVICT_FIFO;
+	} else {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": unknown eviction policy '", cmd->argv[1], "'", NULL));
+	}
+
+	c = add_config_param(cmd->argv[0], 1, NULL);
+	c->argv[0] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[0]) = eviction;
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_http_version(cmd_rec *cmd)
+{
+	config_rec *c;
+	int version;
+
+	CHECK_ARGS(cmd, 1);
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+	if (strcmp(cmd->argv[1], "1.0") == 0) {
+		version = AUTH_WEB_HTTP_1_0;
+	} else if (strcmp(cmd->argv[1], "1.1") == 0) {
+		version = AUTH_WEB_HTTP_1_1;
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	} else if (strcmp(cmd->argv[1], "2") == 0) {
+		version = AUTH_WEB_HTTP_2;
+#endif
+	} else {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": unsupported HTTP version '", cmd->argv[1], "'", NULL));
+	}
+
+	c = add_config_param(cmd->argv[0], 1, NULL);
+	c->argv[0] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[0]) = version;
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_method(cmd_rec *cmd)
+{
+	config_rec *c;
+	int method;
+
+	CHECK_ARGS(cmd, 1);
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+	if (strcasecmp(cmd->argv[1], "POST") == 0) {
+		method = AUTH_WEB_METHOD_POST;
+	} else if (strcasecmp(cmd->argv[1], "GET") == 0) {
+		method = AUTH_WEB_METHOD_GET;
+	} else {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": unsupported method '", cmd->argv[1], "'", NULL));
+	}
+
+	c = add_config_param(cmd->argv[0], 1, NULL);
+	c->argv[0] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[0]) = method;
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_body_format(cmd_rec *cmd)
+{
+	config_rec *c;
+	int format;
+
+	CHECK_ARGS(cmd, 1);
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+	if (strcasecmp(cmd->argv[1], "form") == 0) {
+		format = AUTH_WEB_BODY_FORM;
+	} else if (strcasecmp(cmd->argv[1], "json") == 0) {
+		format = AUTH_WEB_BODY_JSON;
+	} else if (strcasecmp(cmd->argv[1], "none") == 0) {
+		format = AUTH_WEB_BODY_NONE;
+	} else {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": unknown format '", cmd->argv[1], "'", NULL));
+	}
+
+	c = add_config_param(cmd->argv[0], 1, NULL);
+	c->argv[0] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[0]) = format;
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_extra_header(cmd_rec *cmd)
+{
+	struct auth_web_tmpl tmpl;
+	const char *error;
+
+	CHECK_ARGS(cmd, 1);
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+	error = auth_web_tmpl_compile(cmd->tmp_pool, cmd->argv[1], &tmpl);
+	if (error) {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": ", error, NULL));
+	}
+	if (strpbrk(cmd->argv[1], "\r\n")) {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": header must be a single line", NULL));
+	}
+
+	add_config_param_str(cmd->argv[0], 1, cmd->argv[1]);
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_validate_url(cmd_rec *cmd)
+{
+	config_rec *c;
+	char *endp;
+	long ttl = AUTH_WEB_COOKIE_DEFAULT_TTL;
+
+	if (cmd->argc < 2 || cmd->argc > 3) {
+		CONF_ERROR(cmd, "wrong number of parameters");
+	}
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+#ifndef PR_USE_OPENSSL
+	CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], " requires ProFTPD built with OpenSSL support", NULL));
+#endif
+	if (cmd->argc == 3) {
+		ttl = strtol(cmd->argv[2], &endp, 10);
+		if (*endp || ttl < 1 || ttl > 86400 * 30) {
+			CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": '", cmd->argv[2], "' is not a valid lifetime", NULL));
+		}
+	}
+
+	c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+	c->argv[0] = pstrdup(c->pool, cmd->argv[1]);
+	c->argv[1] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[1]) = (int) ttl;
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_warm_up(cmd_rec *cmd)
+{
+	config_rec *c;
+	int enabled;
+
+	if (cmd->argc < 2 || cmd->argc > 3) {
+		CONF_ERROR(cmd, "wrong number of parameters");
+	}
+	CHECK_CONF(cmd, CONF_ROOT);
+
+	enabled = get_boolean(cmd, 1);
+	if (enabled == -1) {
+		CONF_ERROR(cmd, "expected Boolean parameter");
+	}
+	if (cmd->argc == 3 && *((char *) cmd->argv[2]) != '/') {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": '", cmd->argv[2], "' is not an absolute path", NULL));
+	}
+
+	c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+	c->argv[0] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[0]) = enabled;
+	if (cmd->argc == 3) {
+		c->argv[1] = pstrdup(c->pool, cmd->argv[2]);
+	}
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_broker_socket(cmd_rec *cmd)
+{
+	CHECK_ARGS(cmd, 1);
+	CHECK_CONF(cmd, CONF_ROOT);
+
+	if (*((char *) cmd->argv[1]) != '/') {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": '", cmd->argv[1], "' is not an absolute path", NULL));
+	}
+	if (strlen(cmd->argv[1]) >= sizeof(broker_addr.sun_path)) {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": path '", cmd->argv[1], "' is too long", NULL));
+	}
+
+	add_config_param_str(cmd->argv[0], 1, cmd->argv[1]);
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_broker_connections(cmd_rec *cmd)
+{
+	CHECK_CONF(cmd, CONF_ROOT);
+	return set_config_number(cmd);
+}
+
+/* A broker allowed no streams could never send a request. */
+MODRET
+set_broker_streams(cmd_rec *cmd)
+{
+	config_rec *c;
+	char *endp;
+	long streams;
+
+	CHECK_ARGS(cmd, 1);
+	CHECK_CONF(cmd, CONF_ROOT);
+
+	streams = strtol(cmd->argv[1], &endp, 10);
+	if (*((char *) cmd->argv[1]) == 0 || *endp || streams < 1 || streams > INT_MAX) {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": '", cmd->argv[1], "' is not a valid number of streams", NULL));
+	}
+
+	c = add_config_param(cmd->argv[0], 1, NULL);
+	c->argv[0] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[0]) = (int) streams;
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_metrics_file(cmd_rec *cmd)
+{
+	config_rec *c;
+	char *endp;
+	long interval = AUTH_WEB_DEFAULT_METRICS_INTERVAL;
+
+	if (cmd->argc < 2 || cmd->argc > 3) {
+		CONF_ERROR(cmd, "wrong number of parameters");
+	}
+	CHECK_CONF(cmd, CONF_ROOT);
+
+	if (*((char *) cmd->argv[1]) != '/') {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": '", cmd->argv[1], "' is not an absolute path", NULL));
+	}
+	if (cmd->argc == 3) {
+		interval = strtol(cmd->argv[2], &endp, 10);
+		if (*endp || interval < 1 || interval > 86400) {
+			CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": '", cmd->argv[2], "' is not a valid interval", NULL));
+		}
+	}
+
+	c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+	c->argv[0] = pstrdup(c->pool, cmd->argv[1]);
+	c->argv[1] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[1]) = (int) interval;
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_offline_file(cmd_rec *cmd)
+{
+	config_rec *c;
+	char *endp;
+	long ttl = AUTH_WEB_OFFLINE_DEFAULT_TTL;
+
+	if (cmd->argc < 2 || cmd->argc > 3) {
+		CONF_ERROR(cmd, "wrong number of parameters");
+	}
+	CHECK_CONF(cmd, CONF_ROOT);
+
+	if (*((char *) cmd->argv[1]) != '/') {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": '", cmd->argv[1], "' is not an absolute path", NULL));
+	}
+	if (cmd->argc == 3) {
+		ttl = strtol(cmd->argv[2], &endp, 10);
+		if (*endp || ttl < 1 || ttl > 86400 * 30) {
+			CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": '", cmd->argv[2], "' is not a valid lifetime", NULL));
+		}
+	}
+
+	c = add_config_param(cmd->argv[0], 2, NULL, NULL);
+	c->argv[0] = pstrdup(c->pool, cmd->argv[1]);
+	c->argv[1] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[1]) = (int) ttl;
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_config_boolean(cmd_rec *cmd)
+{
+	config_rec *c;
+	int enabled;
+
+	CHECK_ARGS(cmd, 1);
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+	enabled = get_boolean(cmd, 1);
+	if (enabled == -1) {
+		CONF_ERROR(cmd, "expected Boolean parameter");
+	}
+
+	c = add_config_param(cmd->argv[0], 1, NULL);
+	c->argv[0] = pcalloc(c->pool, sizeof(int));
+	*((int *) c->argv[0]) = enabled;
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_tls_session_cache(cmd_rec *cmd)
+{
+	CHECK_CONF(cmd, CONF_ROOT);
+	return set_config_boolean(cmd);
+}
+
+/* Compiles the text of a rule, "[require|deny] subject op value", into
+ * rule. Returns NULL on success, or a description of the problem.
+ *
+ *   subject: status | header:Name | json:path
+ *   op:      = (or ==), !=, ~ (regex), !~
+ *
+ * Status values may be a class such as 3xx.
+ */
+static const char *
+auth_web_rule_compile(pool *p, const char *rule_text, struct auth_web_rule *rule)
+{
+	char *text, *ptr, *endp;
+	int negate = 0;
+
+	memset(rule, 0, sizeof(*rule));
+	while (*rule_text == ' ' || *rule_text == '\t') {
+		++rule_text;
+	}
+	if (strncasecmp(rule_text, "deny", 4) == 0 &&
+	    (rule_text[4] == ' ' || rule_text[4] == '\t')) {
+		rule->deny = 1;
+		rule_text += 5;
+	} else if (strncasecmp(rule_text, "require", 7) == 0 &&
+	           (rule_text[7] == ' ' || rule_text[7] == '\t')) {
+		rule_text += 8;
+	}
+	while (*rule_text == ' ' || *rule_text == '\t') {
+		++rule_text;
+	}
+	rule->text = text = pstrdup(p, rule_text);
+
+	/* subject */
+	for (ptr = text; *ptr && !strchr("=!~ \t", *ptr); ++ptr);
+	if (strncasecmp(text, "status", ptr - text) == 0 && ptr - text == 6) {
+		rule->subject = AUTH_WEB_RULE_STATUS;
+	} else if (strncasecmp(text, "header:", 7) == 0 && ptr - text > 7) {
+		rule->subject = AUTH_WEB_RULE_HEADER;
+		rule->name = pstrndup(p, text + 7, ptr - text - 7);
+	} else if (strncasecmp(text, "json:", 5) == 0 && ptr - text > 5) {
+		rule->subject = AUTH_WEB_RULE_JSON;
+		rule->name = pstrndup(p, text + 5, ptr - text - 5);
+		if (strncmp(rule->name, "$.", 2) == 0) {
+			rule->name += 2;
+		}
+	} else {
+		return pstrcat(p, "unknown subject in '", rule->text, "'", NULL);
+	}
+	if (rule->name) {
+		rule->name_len = strlen(rule->name);
+	}
+
+	/* operator */
+	while (*ptr == ' ' || *ptr == '\t') {
+		++ptr;
+	}
+	if (*ptr == '!') {
+		negate = 1;
+		++ptr;
+	}
+	if (*ptr == '~') {
+		rule->op = AUTH_WEB_RULE_OP_MATCH;
+		++ptr;
+	} else if (*ptr == '=') {
+		rule->op = AUTH_WEB_RULE_OP_EQ;
+		ptr += ptr[1] == '=' ? 2 : 1;
+	} else {
+		return pstrcat(p, "missing operator in '", rule->text, "'", NULL);
+	}
+	rule->deny ^= negate;
+
+	/* value */
+	while (*ptr == ' ' || *ptr == '\t') {
+		++ptr;
+	}
+	rule->value = pstrdup(p, ptr);
+
+	if (rule->subject == AUTH_WEB_RULE_STATUS) {
+		if (rule->op != AUTH_WEB_RULE_OP_EQ) {
+			return "status can only be compared with = or !=";
+		}
+		if (strlen(ptr) == 3 && isdigit((int) ptr[0]) && strcasecmp(ptr + 1, "xx") == 0) {
+			rule->status = ptr[0] - '0';
+		} else {
+			rule->status = strtol(ptr, &endp, 10);
+			if (*ptr == 0 || *endp || rule->status < 100 || rule->status > 999) {
+				return pstrcat(p, "'", ptr, "' is not a valid status", NULL);
+			}
+		}
+
+	} else if (rule->op == AUTH_WEB_RULE_OP_MATCH) {
+		rule->creg = pr_regexp_alloc(&auth_web_module);
+		if (pr_regexp_compile_posix(rule->creg, ptr, REG_EXTENDED | REG_NOSUB) != 0) {
+			return pstrcat(p, "unable to compile regex '", ptr, "'", NULL);
+		}
+	}
+
+	return NULL;
+}
+
+/* usage: AuthWebRule [require|deny] subject op value */
+MODRET
+set_rule(cmd_rec *cmd)
+{
+	struct auth_web_rule *rule;
+	config_rec *c;
+	const char *error;
+	char *text = "";
+	register int i;
+
+	if (cmd->argc < 2) {
+		CONF_ERROR(cmd, "missing parameters");
+	}
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+	c = add_config_param(cmd->argv[0], 1, NULL);
+	rule = pcalloc(c->pool, sizeof(*rule));
+	c->argv[0] = rule;
+
+	for (i = 1; i < cmd->argc; ++i) {
+		text = pstrcat(cmd->tmp_pool, text, *text ? " " : "", cmd->argv[i], NULL);
+	}
+	if ((error = auth_web_rule_compile(c->pool, text, rule)) != NULL) {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": ", error, NULL));
+	}
+
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_user_regex(cmd_rec *cmd)
+{
+	struct auth_web_user_match *m;
+	config_rec *c;
+	const char *pattern = cmd->argv[1], *end;
+	int anchor_start = 0, anchor_end = 0, any = 0;
+	char *lit;
+	size_t n = 0;
+
+	CHECK_ARGS(cmd, 1);
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+	c = add_config_param(cmd->argv[0], 1, NULL);
+	m = pcalloc(c->pool, sizeof(*m));
+	c->argv[0] = m;
+
+	m->creg = pr_regexp_alloc(&auth_web_module);
+	if (pr_regexp_compile_posix(m->creg, pattern, REG_ICASE | REG_EXTENDED | REG_NOSUB) != 0) {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": unable to compile regex '", pattern, "'", NULL));
+	}
+
+	/* Look for a literal, optionally anchored at either end. */
+	end = pattern + strlen(pattern);
+	if (*pattern == '^') {
+		anchor_start = 1;
+		++pattern;
+	}
+	if (end > pattern && end[-1] == '$' && (end - 1 == pattern || end[-2] != '\\')) {
+		anchor_end = 1;
+		--end;
+	}
+
+	m->literal = lit = pcalloc(c->pool, end - pattern + 1);
+	m->any = pcalloc(c->pool, end - pattern + 1);
+	for (; pattern < end; ++pattern, ++n) {
+		if (*pattern == '\\' && pattern + 1 < end &&
+		    strchr(".[]()*+?{}|^$\\", pattern[1])) {
+			lit[n] = *++pattern;
+		} else if (*pattern == '.') {
+			m->any[n] = any = 1;
+		} else if (strchr("[]()*+?{}|^$\\", *pattern)) {
+			break;
+		} else {
+			lit[n] = *pattern;
+		}
+	}
+	if (pattern < end) {
+		m->kind = AUTH_WEB_MATCH_REGEX;
+		return PR_HANDLED(cmd);
+	}
+
+	m->len = n;
+	if (!any) {
+		m->any = NULL;
+	}
+	m->kind = anchor_start ?
+		(anchor_end ? AUTH_WEB_MATCH_EXACT : AUTH_WEB_MATCH_PREFIX) :
+		(anchor_end ? AUTH_WEB_MATCH_SUFFIX : AUTH_WEB_MATCH_CONTAINS);
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_route_file(cmd_rec *cmd)
+{
+	CHECK_ARGS(cmd, 1);
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+	if (*((char *) cmd->argv[1]) != '/') {
+		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": '", cmd->argv[1], "' is not an absolute path", NULL));
+	}
+	add_config_param_str(cmd->argv[0], 1, cmd->argv[1]);
+	return PR_HANDLED(cmd);
+}
+
+MODRET
+set_user_suffix(cmd_rec *cmd)
+{
+	config_rec *c;
+	register int i;
+
+	if (cmd->argc < 2) {
+		CONF_ERROR(cmd, "missing parameters");
+	}
+	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+
+	c = add_config_param(cmd->argv[0], 0);
+	c->argc = cmd->argc - 1;
+	c->argv = pcalloc(c->pool, cmd->argc * sizeof(void *));
+	for (i = 1; i < cmd->argc; ++i) {
+		if (*((char *) cmd->argv[i]) == 0) {
+			CONF_ERROR(cmd, "empty suffix");
+		}
+		c->argv[i - 1] = pstrdup(c->pool, cmd->argv[i]);
+	}
+	return PR_HANDLED(cmd);
+}
+
+static void
+auth_web_cache_free(struct auth_web_cache **table)
+{
+	if (*table) {
+		pr_log_pri(PR_LOG_INFO, MOD_AUTH_WEB_VERSION ": %s: %lu hits, %lu misses, %lu stores, %lu evictions",
+			(*table)->name, (*table)->hits, (*table)->misses,
+			(*table)->stores, (*table)->evictions);
+		munmap(*table, (*table)->len);
+		*table = NULL;
+	}
+}
+
+static int
+auth_web_cache_enabled(const char *directive)
+{
+	server_rec *s;
+	int *ttl;
+
+	for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+		ttl = (int *) get_param_ptr(s->conf, directive, FALSE);
+		if (ttl && *ttl > 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Fills salt, AUTH_WEB_CACHE_SALT_LEN + 1 bytes, with a random string. */
+static void
+auth_web_salt_init(char *salt)
+{
+	int fd;
+	register unsigned int i;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0 || read(fd, salt, AUTH_WEB_CACHE_SALT_LEN) != AUTH_WEB_CACHE_SALT_LEN) {
+		srandom(time(NULL) ^ getpid());
+		for (i = 0; i < AUTH_WEB_CACHE_SALT_LEN; ++i) {
+			salt[i] = random();
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	/* Keep the salt printable; auth_web_hash() treats it as a string. */
+	for (i = 0; i < AUTH_WEB_CACHE_SALT_LEN; ++i) {
+		salt[i] = 'A' + ((unsigned char) salt[i] % 26);
+	}
+	salt[AUTH_WEB_CACHE_SALT_LEN] = 0;
+}
+
+static struct auth_web_cache *
+auth_web_cache_alloc(const char *name, unsigned int entries, int by_hash)
+{
+	struct auth_web_cache *table;
+	size_t len;
+	int *eviction;
+
+	len = sizeof(struct auth_web_cache) +
+		entries * sizeof(struct auth_web_cache_entry);
+	table = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (table == MAP_FAILED) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to allocate %s: %s", name, strerror(errno));
+		return NULL;
+	}
+	table->name = name;
+	table->len = len;
+	table->size = entries;
+	table->probes = entries < AUTH_WEB_CACHE_PROBES ?
+		entries : AUTH_WEB_CACHE_PROBES;
+	eviction = (int *) get_param_ptr(main_server->conf, "AuthWebCacheEviction", FALSE);
+	table->eviction = eviction ? *eviction : AUTH_WEB_CACHE_EVICT_LRU;
+	table->by_hash = by_hash;
+
+	auth_web_salt_init(table->salt);
+
+	pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": allocated %s with %u entries", name, entries);
+	return table;
+}
+
+static struct auth_web_cache *
+auth_web_cache_create(const char *name, int by_hash)
+{
+	unsigned int entries;
+	int *size;
+
+	size = (int *) get_param_ptr(main_server->conf, "AuthWebCacheSize", FALSE);
+	entries = size ? *size : AUTH_WEB_CACHE_DEFAULT_SIZE;
+	if (entries == 0) {
+		return NULL;
+	}
+	return auth_web_cache_alloc(name, entries, by_hash);
+}
+
+static void
+auth_web_cache_init(void)
+{
+	auth_web_cache_free(&cache);
+	auth_web_cache_free(&neg_cache);
+
+	if (auth_web_cache_enabled("AuthWebCacheTTL")) {
+		cache = auth_web_cache_create("credential cache", FALSE);
+	}
+	if (auth_web_cache_enabled("AuthWebNegativeCacheTTL")) {
+		neg_cache = auth_web_cache_create("negative cache", TRUE);
+	}
+}
+
+static void
+auth_web_offline_free(void)
+{
+	if (offline_map) {
+		pr_log_pri(PR_LOG_INFO, MOD_AUTH_WEB_VERSION ": %s: %lu hits, %lu misses, %lu stores, %lu evictions",
+			offline->name, offline->hits, offline->misses, offline->stores,
+			offline->evictions);
+		munmap(offline_map, offline_map_len);
+		offline_map = NULL;
+		offline = NULL;
+	}
+	auth_web_cache_free(&offline_prints);
+}
+
+/* Identifies the servers, in order, so that an offline file is only used
+ * while its entries' server IDs still mean the same servers.
+ */
+static unsigned long
+auth_web_offline_layout(void)
+{
+	server_rec *s;
+	char id[32];
+	unsigned long hash = 0;
+
+	for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+		snprintf(id, sizeof(id), "%u:%u:", s->sid, s->ServerPort);
+		hash = auth_web_hash(id, hash);
+		hash = auth_web_hash(s->addr ? pr_netaddr_get_ipstr(s->addr) : "", hash);
+		hash = auth_web_hash(s->ServerName ? s->ServerName : "", hash);
+	}
+	return hash;
+}
+
+/* Maps path, which must be len bytes long and have a header matching
+ * layout, returning MAP_FAILED if it can't be used.
+ */
+static void *
+auth_web_offline_open(const char *path, size_t len, unsigned long layout)
+{
+	struct auth_web_offline_header *header;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDWR | O_NOFOLLOW);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to open %s: %s", path, strerror(errno));
+		}
+		return MAP_FAILED;
+	}
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (size_t) st.st_size != len) {
+		close(fd);
+		return MAP_FAILED;
+	}
+
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return MAP_FAILED;
+	}
+	header = map;
+	if (memcmp(header->magic, AUTH_WEB_OFFLINE_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->layout != layout || header->len != len) {
+		munmap(map, len);
+		return MAP_FAILED;
+	}
+	return map;
+}
+
+/* Writes an empty offline file for layout beside path and renames it into
+ * place, returning its mapping, or MAP_FAILED.
+ */
+static void *
+auth_web_offline_create(const char *path, size_t len, unsigned int entries,
+                        unsigned long layout)
+{
+	struct auth_web_offline_header *header;
+	struct auth_web_cache *table;
+	char *tmp_path;
+	void *map;
+	int fd, res;
+
+	/* A unique name, so a file left by a crash can't block the store. */
+	tmp_path = pstrcat(auth_web_conf_pool, path, ".XXXXXX", NULL);
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to create %s: %s", tmp_path, strerror(errno));
+		return MAP_FAILED;
+	}
+
+	/* Allocate the blocks now, so a full disk can't fault a session later. */
+	res = posix_fallocate(fd, 0, len);
+	map = res == 0 ? mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) :
+		MAP_FAILED;
+	if (map == MAP_FAILED) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to allocate %s: %s", tmp_path, strerror(res ? res : errno));
+		close(fd);
+		unlink(tmp_path);
+		return MAP_FAILED;
+	}
+	close(fd);
+
+	table = (struct auth_web_cache *) ((char *) map + AUTH_WEB_OFFLINE_TABLE);
+	table->len = len;
+	table->size = entries;
+	auth_web_salt_init(table->salt);
+	header = map;
+	header->layout = layout;
+	header->len = len;
+	memcpy(header->magic, AUTH_WEB_OFFLINE_MAGIC, sizeof(header->magic));
+
+	if (msync(map, len, MS_SYNC) < 0 || rename(tmp_path, path) < 0) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to write %s: %s", path, strerror(errno));
+		munmap(map, len);
+		unlink(tmp_path);
+		return MAP_FAILED;
+	}
+	return map;
+}
+
+/* Must run after auth_web_confs_init(). */
+static void
+auth_web_offline_init(void)
+{
+	config_rec *c;
+	struct auth_web_cache *table;
+	const char *path;
+	unsigned int entries;
+	unsigned long layout;
+	size_t len;
+	void *map;
+	int *size;
+	register unsigned int i;
+
+	auth_web_offline_free();
+
+	c = find_config(main_server->conf, CONF_PARAM, "AuthWebOfflineFile", FALSE);
+	if (!c) {
+		return;
+	}
+	path = c->argv[0];
+	offline_ttl = *((int *) c->argv[1]);
+
+	size = (int *) get_param_ptr(main_server->conf, "AuthWebCacheSize", FALSE);
+	entries = size && *size > 0 ? *size : AUTH_WEB_CACHE_DEFAULT_SIZE;
+	len = AUTH_WEB_OFFLINE_TABLE + sizeof(struct auth_web_cache) +
+		entries * sizeof(struct auth_web_cache_entry);
+	layout = auth_web_offline_layout();
+
+	offline_prints = auth_web_cache_alloc("offline fingerprints", entries, FALSE);
+	if (!offline_prints) {
+		return;
+	}
+	if (cache) {
+		/* So that the credential cache's hashes serve as fingerprints. */
+		memcpy(offline_prints->salt, cache->salt, sizeof(cache->salt));
+	}
+
+	map = auth_web_offline_open(path, len, layout);
+	if (map == MAP_FAILED) {
+		pr_log_pri(PR_LOG_INFO, MOD_AUTH_WEB_VERSION ": starting new offline store in %s", path);
+		map = auth_web_offline_create(path, len, entries, layout);
+		if (map == MAP_FAILED) {
+			auth_web_cache_free(&offline_prints);
+			return;
+		}
+	}
+
+	table = (struct auth_web_cache *) ((char *) map + AUTH_WEB_OFFLINE_TABLE);
+	table->name = "offline store";
+	table->probes = entries < AUTH_WEB_CACHE_PROBES ?
+		entries : AUTH_WEB_CACHE_PROBES;
+	table->eviction = AUTH_WEB_CACHE_EVICT_LRU;
+	table->by_hash = FALSE;
+
+	/* Locks held when the daemon last stopped belong to processes that are
+	 * gone, but whose IDs may since have been reused. On a restart, or under
+	 * inetd, other sessions may be holding them now.
+	 */
+	if (!offline_opened && ServerType != SERVER_INETD) {
+		for (i = 0; i < entries; ++i) {
+			table->entries[i].lock = 0;
+			table->entries[i].refreshing = 0;
+		}
+	}
+	offline_opened = 1;
+
+	offline_map = map;
+	offline_map_len = len;
+	offline = table;
+	pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": mapped offline store %s with %u entries", path, entries);
+}
+
+static void
+auth_web_cookies_free(void)
+{
+	if (cookies) {
+		munmap(cookies, cookies_len);
+		cookies = NULL;
+	}
+	pr_memscrub(cookie_secret, sizeof(cookie_secret));
+}
+
+/* Must run after auth_web_cache_init(). */
+static void
+auth_web_cookies_init(void)
+{
+	server_rec *s;
+
+	auth_web_cookies_free();
+	if (!cache) {
+		return;
+	}
+	for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+		if (get_param_ptr(s->conf, "AuthWebValidateURL", FALSE)) {
+			break;
+		}
+	}
+	if (!s) {
+		return;
+	}
+
+#ifdef PR_USE_OPENSSL
+	if (RAND_bytes(cookie_secret, sizeof(cookie_secret)) != 1) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to generate cookie key");
+		return;
+	}
+	cookies_len = cache->size * sizeof(struct auth_web_cookie);
+	cookies = mmap(NULL, cookies_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (cookies == MAP_FAILED) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to allocate cookie table: %s", strerror(errno));
+		cookies = NULL;
+	}
+#endif
+}
+
+static void
+auth_web_flights_free(void)
+{
+	if (flights) {
+		munmap(flights, sizeof(*flights));
+		flights = NULL;
+	}
+}
+
+static void
+auth_web_flights_init(void)
+{
+	auth_web_flights_free();
+	if (!auth_web_cache_enabled("AuthWebCoalesce")) {
+		return;
+	}
+
+	flights = mmap(NULL, sizeof(*flights), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (flights == MAP_FAILED) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to allocate in-flight login table: %s", strerror(errno));
+		flights = NULL;
+		return;
+	}
+	auth_web_salt_init(flights->salt);
+}
+
+static void
+auth_web_stats_log(const char *name, const struct auth_web_hist *hist)
+{
+	int64_t p50, p99, p999;
+	uint64_t n;
+
+	p50 = auth_web_hist_quantile(hist, 0.5, &n);
+	if (n == 0) {
+		return;
+	}
+	p99 = auth_web_hist_quantile(hist, 0.99, &n);
+	p999 = auth_web_hist_quantile(hist, 0.999, &n);
+	pr_log_pri(PR_LOG_INFO, MOD_AUTH_WEB_VERSION ": %s: %llu samples, p50 %lldus, p99 %lldus, p999 %lldus",
+		name, (unsigned long long) n, (long long) p50, (long long) p99,
+		(long long) p999);
+}
+
+static void
+auth_web_stats_free(void)
+{
+	static const char *phases[AUTH_WEB_PHASES] = {
+		"dns", "connect", "tls", "first byte", "total"
+	};
+	char name[sizeof(backends->url) + 16];
+	register unsigned int i, j;
+
+	if (!stats) {
+		return;
+	}
+
+	for (i = 0; i < nbackends; ++i) {
+		struct auth_web_backend_stats *bs = &stats->backends[i];
+
+		if (bs->requests == 0) {
+			continue;
+		}
+		pr_log_pri(PR_LOG_INFO, MOD_AUTH_WEB_VERSION ": %s: %llu requests, %llu on reused connections, %llu bytes received",
+			backends[i].url, (unsigned long long) bs->requests,
+			(unsigned long long) bs->reused, (unsigned long long) bs->bytes);
+		for (j = 0; j < AUTH_WEB_PHASES; ++j) {
+			snprintf(name, sizeof(name), "%s %s", backends[i].url, phases[j]);
+			auth_web_stats_log(name, &bs->phase[j]);
+		}
+	}
+	auth_web_stats_log("cache lookup", &stats->cache_lookup);
+	auth_web_stats_log("rule evaluation", &stats->rules);
+
+	munmap(stats, stats->len);
+	stats = NULL;
+}
+
+static void
+auth_web_stats_init(void)
+{
+	size_t len = sizeof(struct auth_web_stats) +
+		nbackends * sizeof(struct auth_web_backend_stats);
+
+	stats = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to allocate latency statistics: %s", strerror(errno));
+		stats = NULL;
+		return;
+	}
+	stats->len = len;
+}
+
+static void
+auth_web_backends_free(void)
+{
+	auth_web_stats_free();
+	if (backends) {
+		munmap(backends, backends_len);
+		backends = NULL;
+		nbackends = 0;
+	}
+}
+
+static void
+auth_web_backends_collect(array_header *found, array_header *conf_urls)
+{
+	register unsigned int i;
+
+	for (i = 0; conf_urls && i < conf_urls->nelts; ++i) {
+		*((struct auth_web_url **) push_array(found)) =
+			&((struct auth_web_url *) conf_urls->elts)[i];
+	}
+}
+
+/* Must run after auth_web_confs_init(); every configured URL, including
+ * those of AuthWebRouteFile tenants, is bound to its backend here.
+ */
+static void
+auth_web_backends_init(void)
+{
+	struct auth_web_conf *sconf, **tenants;
+	array_header *found;
+	pool *tmp_pool;
+	unsigned int n;
+	register unsigned int i;
+
+	auth_web_backends_free();
+
+	tmp_pool = make_sub_pool(permanent_pool);
+	found = make_array(tmp_pool, 4, sizeof(struct auth_web_url *));
+	for (sconf = auth_web_confs; sconf; sconf = sconf->next) {
+		auth_web_backends_collect(found, sconf->urls);
+		if (!sconf->routes) {
+			continue;
+		}
+
+		/* Most tenants share the server's URLs. */
+		tenants = (struct auth_web_conf **) sconf->routes->tenants->elts;
+		for (i = 0; i < sconf->routes->tenants->nelts; ++i) {
+			if (tenants[i]->urls != sconf->urls) {
+				auth_web_backends_collect(found, tenants[i]->urls);
+			}
+		}
+	}
+
+	if (found->nelts > 0) {
+		backends_len = found->nelts * sizeof(struct auth_web_backend);
+		backends = mmap(NULL, backends_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (backends == MAP_FAILED) {
+			pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to allocate backend table: %s", strerror(errno));
+			backends = NULL;
+		}
+	}
+
+	/* nbackends counts distinct URLs; duplicates share an entry. */
+	for (n = 0; backends && n < found->nelts; ++n) {
+		struct auth_web_url *u = ((struct auth_web_url **) found->elts)[n];
+
+		u->backend = auth_web_backend_find(u->url);
+		if (u->backend) {
+			continue;
+		}
+		backends[nbackends].key = auth_web_hash(u->url, 0);
+		sstrncpy(backends[nbackends].url, u->url, sizeof(backends[nbackends].url));
+		u->backend = &backends[nbackends++];
+	}
+
+	destroy_pool(tmp_pool);
+	auth_web_stats_init();
+}
+
+static void
+auth_web_share_free(void)
+{
+	if (share) {
+		curl_share_cleanup(share);
+		share = NULL;
+	}
+	if (tls_sessions) {
+		munmap(tls_sessions, AUTH_WEB_TLS_SESSIONS * sizeof(struct auth_web_tls_session));
+		tls_sessions = NULL;
+	}
+}
+
+static void
+auth_web_share_init(void)
+{
+	int *enabled;
+
+	auth_web_share_free();
+
+	enabled = (int *) get_param_ptr(main_server->conf, "AuthWebTLSSessionCache", FALSE);
+	if (!enabled || !*enabled) {
+		return;
+	}
+
+	share = curl_share_init();
+	if (!share) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to create libcurl share");
+		return;
+	}
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+#if LIBCURL_VERSION_NUM >= 0x080c00
+	tls_sessions = mmap(NULL,
+		AUTH_WEB_TLS_SESSIONS * sizeof(struct auth_web_tls_session),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (tls_sessions == MAP_FAILED) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to allocate TLS session store: %s", strerror(errno));
+		tls_sessions = NULL;
+	}
+#else
+	pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": TLS sessions can't be shared between sessions with libcurl older than 8.12.0");
+#endif
+}
+
+/* Gives up root for good in a helper process, taking the User and Group
+ * of the server and dropping root's supplementary groups.
+ */
+static int
+auth_web_drop_privs(void)
+{
+	uid_t *uid = (uid_t *) get_param_ptr(main_server->conf, "UserID", FALSE);
+	gid_t *gid = (gid_t *) get_param_ptr(main_server->conf, "GroupID", FALSE);
+
+	if ((geteuid() == 0 && setgroups(0, NULL) < 0) ||
+	    (gid && setgid(*gid) < 0) || (uid && setuid(*uid) < 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+static void
+auth_web_broker_stop(void)
+{
+	if (broker_pid > 0) {
+		kill(broker_pid, SIGTERM);
+		broker_pid = 0;
+		unlink(broker_addr.sun_path);
+	}
+	if (broker_ctl_fd >= 0) {
+		close(broker_ctl_fd);
+		broker_ctl_fd = -1;
+	}
+}
+
+static void
+auth_web_broker_start(void)
+{
+	char *path;
+	int *conns, *streams, listen_fd, ctl_fds[2], ready_fds[2];
+	pid_t pid;
+
+	path = (char *) get_param_ptr(main_server->conf, "AuthWebBrokerSocket", FALSE);
+	if (!path) {
+		return;
+	}
+	if (ServerType == SERVER_INETD) {
+		pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": AuthWebBrokerSocket is ignored when ServerType is inetd");
+		return;
+	}
+	conns = (int *) get_param_ptr(main_server->conf, "AuthWebBrokerConnections", FALSE);
+	streams = (int *) get_param_ptr(main_server->conf, "AuthWebBrokerStreams", FALSE);
+
+	memset(&broker_addr, 0, sizeof(broker_addr));
+	broker_addr.sun_family = AF_UNIX;
+	sstrncpy(broker_addr.sun_path, path, sizeof(broker_addr.sun_path));
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to create broker socket: %s", strerror(errno));
+		return;
+	}
+	unlink(broker_addr.sun_path);
+	if (bind(listen_fd, (struct sockaddr *) &broker_addr, sizeof(broker_addr)) < 0 ||
+	    chmod(broker_addr.sun_path, 0600) < 0 ||
+	    listen(listen_fd, AUTH_WEB_BROKER_MAX_PENDING) < 0 ||
+	    pipe(ctl_fds) < 0) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to listen on broker socket %s: %s", broker_addr.sun_path, strerror(errno));
+		close(listen_fd);
+		return;
+	}
+	if (pipe(ready_fds) < 0) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to start broker: %s", strerror(errno));
+		close(listen_fd);
+		close(ctl_fds[0]);
+		close(ctl_fds[1]);
+		return;
+	}
+	fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+
+	pid = fork();
+	if (pid < 0) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to fork broker: %s", strerror(errno));
+		close(listen_fd);
+		close(ctl_fds[0]);
+		close(ctl_fds[1]);
+		close(ready_fds[0]);
+		close(ready_fds[1]);
+		return;
+	}
+
+	if (pid == 0) {
+		close(ctl_fds[1]);
+		close(ready_fds[0]);
+		signal(SIGHUP, SIG_IGN);
+		signal(SIGPIPE, SIG_IGN);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGALRM, SIG_DFL);
+
+		/* The socket is bound; nothing else here needs root. */
+		if (auth_web_drop_privs() < 0) {
+			pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": broker unable to drop privileges: %s", strerror(errno));
+			_exit(1);
+		}
+
+		auth_web_broker_main(listen_fd, ctl_fds[0], ready_fds[1],
+			conns ? *conns : AUTH_WEB_BROKER_DEFAULT_CONNS,
+			streams ? *streams : AUTH_WEB_BROKER_DEFAULT_STREAMS);
+		_exit(0);
+	}
+
+	close(listen_fd);
+	close(ctl_fds[0]);
+	close(ready_fds[1]);
+	broker_ctl_fd = ctl_fds[1];
+	broker_pid = pid;
+
+	auth_web_warm_up_wait(ready_fds[0]);
+	close(ready_fds[0]);
+}
+
+/* Writes a label value, escaped for the Prometheus text format. */
+static void
+auth_web_metrics_label(FILE *fh, const char *value)
+{
+	for (; *value; ++value) {
+		if (*value == '"' || *value == '\\') {
+			fputc('\\', fh);
+		} else if (*value == '\n') {
+			fputs("\\n", fh);
+			continue;
+		}
+		fputc(*value, fh);
+	}
+}
+
+static void
+auth_web_metrics_counter(FILE *fh, const char *name, const char *help)
+{
+	fprintf(fh, "# HELP auth_web_%s %s\n# TYPE auth_web_%s counter\n",
+		name, help, name);
+}
+
+static void
+auth_web_metrics_cache(FILE *fh, const char *name, struct auth_web_cache *table)
+{
+	if (!table) {
+		return;
+	}
+	fprintf(fh, "auth_web_cache_hits_total{cache=\"%s\"} %lu\n", name, table->hits);
+	fprintf(fh, "auth_web_cache_misses_total{cache=\"%s\"} %lu\n", name, table->misses);
+}
+
+static void
+auth_web_metrics_quantiles(FILE *fh, const char *url, const char *phase,
+                           const struct auth_web_hist *hist)
+{
+	static const double quantiles[] = { 0.5, 0.99, 0.999 };
+	uint64_t n;
+	register unsigned int i;
+
+	for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i) {
+		int64_t v = auth_web_hist_quantile(hist, quantiles[i], &n);
+
+		if (n == 0) {
+			return;
+		}
+		fputs("auth_web_latency_seconds{", fh);
+		if (url) {
+			fputs("url=\"", fh);
+			auth_web_metrics_label(fh, url);
+			fputs("\",", fh);
+		}
+		fprintf(fh, "phase=\"%s\",quantile=\"%g\"} %.6f\n", phase,
+			quantiles[i], v / 1000000.0);
+	}
+}
+
+/* Writes the current counters to a temporary file and renames it over
+ * path, so that readers never see a partial file.
+ */
+static void
+auth_web_metrics_write(const char *path, const char *tmp_path)
+{
+	static const char *phases[AUTH_WEB_PHASES] = {
+		"dns", "connect", "tls", "first_byte", "total"
+	};
+	FILE *fh;
+	int fd;
+	register unsigned int i, j;
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || !(fh = fdopen(fd, "w"))) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to write %s: %s", tmp_path, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return;
+	}
+
+	auth_web_metrics_counter(fh, "attempts_total", "Logins handled.");
+	fprintf(fh, "auth_web_attempts_total %llu\n", (unsigned long long) stats->attempts);
+	auth_web_metrics_counter(fh, "successes_total", "Logins accepted.");
+	fprintf(fh, "auth_web_successes_total %llu\n", (unsigned long long) stats->successes);
+	auth_web_metrics_counter(fh, "rejections_total", "Logins rejected with a bad password.");
+	fprintf(fh, "auth_web_rejections_total %llu\n", (unsigned long long) stats->rejections);
+	auth_web_metrics_counter(fh, "declines_total", "Logins declined because no URL gave an answer.");
+	fprintf(fh, "auth_web_declines_total %llu\n", (unsigned long long) stats->declines);
+	auth_web_metrics_counter(fh, "coalesced_total", "Logins that waited for an identical login.");
+	fprintf(fh, "auth_web_coalesced_total %llu\n", (unsigned long long) stats->coalesced);
+	auth_web_metrics_counter(fh, "breaker_trips_total", "Circuit breakers opened.");
+	fprintf(fh, "auth_web_breaker_trips_total %llu\n", (unsigned long long) stats->breaker_trips);
+	auth_web_metrics_counter(fh, "offline_logins_total", "Logins verified with AuthWebOfflineFile.");
+	fprintf(fh, "auth_web_offline_logins_total %llu\n", (unsigned long long) stats->offline_logins);
+
+	auth_web_metrics_counter(fh, "curl_errors_total", "Failed requests, by CURLcode.");
+	for (i = 0; i < AUTH_WEB_CURL_CODES; ++i) {
+		if (stats->curl_errors[i]) {
+			fprintf(fh, "auth_web_curl_errors_total{code=\"%u\"} %llu\n", i,
+				(unsigned long long) stats->curl_errors[i]);
+		}
+	}
+
+	auth_web_metrics_counter(fh, "cache_hits_total", "Cache lookups that found a login.");
+	auth_web_metrics_counter(fh, "cache_misses_total", "Cache lookups that found nothing.");
+	auth_web_metrics_cache(fh, "positive", cache);
+	auth_web_metrics_cache(fh, "negative", neg_cache);
+
+	auth_web_metrics_counter(fh, "requests_total", "Requests sent, by URL.");
+	auth_web_metrics_counter(fh, "reused_total", "Requests sent on a reused connection, by URL.");
+	auth_web_metrics_counter(fh, "received_bytes_total", "Response bytes received, by URL.");
+	for (i = 0; i < nbackends; ++i) {
+		struct auth_web_backend_stats *bs = &stats->backends[i];
+		static const char *names[] = { "requests", "reused", "received_bytes" };
+		uint64_t values[3];
+
+		values[0] = bs->requests;
+		values[1] = bs->reused;
+		values[2] = bs->bytes;
+		for (j = 0; j < 3; ++j) {
+			fprintf(fh, "auth_web_%s_total{url=\"", names[j]);
+			auth_web_metrics_label(fh, backends[i].url);
+			fprintf(fh, "\"} %llu\n", (unsigned long long) values[j]);
+		}
+	}
+
+	fputs("# HELP auth_web_latency_seconds Latency quantiles.\n"
+		"# TYPE auth_web_latency_seconds summary\n", fh);
+	for (i = 0; i < nbackends; ++i) {
+		for (j = 0; j < AUTH_WEB_PHASES; ++j) {
+			auth_web_metrics_quantiles(fh, backends[i].url, phases[j],
+				&stats->backends[i].phase[j]);
+		}
+	}
+	auth_web_metrics_quantiles(fh, NULL, "cache_lookup", &stats->cache_lookup);
+	auth_web_metrics_quantiles(fh, NULL, "rules", &stats->rules);
+
+	if (fclose(fh) != 0 || rename(tmp_path, path) < 0) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to write %s: %s", path, strerror(errno));
+		unlink(tmp_path);
+	}
+}
+
+static void
+auth_web_metrics_stop(void)
+{
+	if (metrics_pid > 0) {
+		kill(metrics_pid, SIGTERM);
+		metrics_pid = 0;
+	}
+	if (metrics_ctl_fd >= 0) {
+		close(metrics_ctl_fd);
+		metrics_ctl_fd = -1;
+	}
+}
+
+/* Starts a helper process that rewrites AuthWebMetricsFile every interval.
+ * Counters are read straight from shared memory, so sessions do nothing
+ * for it beyond their atomic increments.
+ */
+static void
+auth_web_metrics_start(void)
+{
+	config_rec *c;
+	char *path, *tmp_path;
+	int ctl_fds[2], interval;
+	pid_t pid;
+
+	c = find_config(main_server->conf, CONF_PARAM, "AuthWebMetricsFile", FALSE);
+	if (!c || !stats) {
+		return;
+	}
+	if (ServerType == SERVER_INETD) {
+		pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": AuthWebMetricsFile is ignored when ServerType is inetd");
+		return;
+	}
+	path = c->argv[0];
+	interval = *((int *) c->argv[1]);
+	tmp_path = pstrcat(auth_web_conf_pool, path, ".tmp", NULL);
+
+	if (pipe(ctl_fds) < 0) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to start metrics writer: %s", strerror(errno));
+		return;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to fork metrics writer: %s", strerror(errno));
+		close(ctl_fds[0]);
+		close(ctl_fds[1]);
+		return;
+	}
+
+	if (pid == 0) {
+		struct pollfd pfd;
+
+		close(ctl_fds[1]);
+		signal(SIGHUP, SIG_IGN);
+		signal(SIGPIPE, SIG_IGN);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGCHLD, SIG_DFL);
+		signal(SIGALRM, SIG_DFL);
+
+		if (auth_web_drop_privs() < 0) {
+			pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": metrics writer unable to drop privileges: %s", strerror(errno));
+			_exit(1);
+		}
+
+		/* The pipe becomes readable when the daemon exits. */
+		pfd.fd = ctl_fds[0];
+		pfd.events = POLLIN;
+		for (;;) {
+			int res;
+
+			auth_web_metrics_write(path, tmp_path);
+			res = poll(&pfd, 1, interval * 1000);
+			if (res > 0 || (res < 0 && errno != EINTR)) {
+				break;
+			}
+		}
+		_exit(0);
+	}
+
+	close(ctl_fds[0]);
+	metrics_ctl_fd = ctl_fds[1];
+	metrics_pid = pid;
+}
+
+static struct curl_slist *
+auth_web_header_node(pool *p, char *data, struct curl_slist *next)
+{
+	struct curl_slist *node = pcalloc(p, sizeof(*node));
+
+	node->data = data;
+	node->next = next;
+	return node;
+}
+
+/* Builds sconf->headers once, from nodes allocated in p rather than by
+ * curl_slist_append(), so that logins never rebuild it.
+ */
+static void
+auth_web_conf_headers(pool *p, struct auth_web_conf *sconf)
+{
+	struct curl_slist *list = NULL, **tail = &list;
+	struct auth_web_tmpl *tmpl;
+	register unsigned int i;
+
+	*tail = auth_web_header_node(p, auth_web_headers->data, NULL);
+	tail = &(*tail)->next;
+	if (sconf->body_format == AUTH_WEB_BODY_JSON) {
+		*tail = auth_web_header_node(p, "Content-Type: application/json", NULL);
+		tail = &(*tail)->next;
+	}
+
+	sconf->header_tmpls = NULL;
+	for (i = 0; sconf->extra_headers && i < sconf->extra_headers->nelts; ++i) {
+		struct auth_web_tmpl compiled;
+		char *text = ((char **) sconf->extra_headers->elts)[i];
+
+		if (auth_web_tmpl_compile(p, text, &compiled) != NULL) {
+			continue;
+		}
+		if (compiled.nslots == 0) {
+			/* %% still needs collapsing. */
+			char *data = palloc(p, compiled.fixed_len + 1), *d = data;
+			unsigned int j;
+
+			for (j = 0; j < compiled.nparts; ++j) {
+				memcpy(d, compiled.parts[j].text, compiled.parts[j].len);
+				d += compiled.parts[j].len;
+			}
+			*d = 0;
+			*tail = auth_web_header_node(p, data, NULL);
+			tail = &(*tail)->next;
+			continue;
+		}
+
+		if (!sconf->header_tmpls) {
+			sconf->header_tmpls = make_array(p, 1, sizeof(struct auth_web_tmpl));
+		}
+		tmpl = push_array(sconf->header_tmpls);
+		*tmpl = compiled;
+	}
+	sconf->static_headers = list;
+
+	/* Headers with slots go in front, with their data set per login. */
+	if (sconf->header_tmpls) {
+		tmpl = (struct auth_web_tmpl *) sconf->header_tmpls->elts;
+		for (i = sconf->header_tmpls->nelts; i > 0; --i) {
+			list = tmpl[i - 1].node = auth_web_header_node(p, "", list);
+		}
+	}
+	sconf->headers = list;
+}
+
+/* Computes the values derived from a configuration, and returns 1 if it has
+ * everything needed to authenticate.
+ */
+static int
+auth_web_conf_finish(pool *p, struct auth_web_conf *sconf)
+{
+	struct auth_web_rule *rule;
+	register unsigned int i;
+
+	sconf->failed_string_len = 0;
+	sconf->failed_string_next = NULL;
+	if (sconf->failed_string) {
+		sconf->failed_string_len = strlen(sconf->failed_string);
+		sconf->failed_string_next = auth_web_kmp_table(p, sconf->failed_string,
+			sconf->failed_string_len);
+	}
+
+	sconf->rules_need_body = 0;
+	for (i = 0; sconf->rules && i < sconf->rules->nelts; ++i) {
+		rule = &((struct auth_web_rule *) sconf->rules->elts)[i];
+		if (rule->subject == AUTH_WEB_RULE_JSON) {
+			sconf->rules_need_body = 1;
+		}
+	}
+
+	if (!sconf->urls || !sconf->local_user ||
+	    (sconf->body_format != AUTH_WEB_BODY_NONE &&
+	     (!sconf->user_param_name || !sconf->pass_param_name)) ||
+	    !(sconf->failed_string || sconf->required_headers || sconf->rules)) {
+		return 0;
+	}
+	if (sconf->method == AUTH_WEB_METHOD_GET &&
+	    sconf->body_format == AUTH_WEB_BODY_JSON) {
+		pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": AuthWebBodyFormat json can't be used with AuthWebMethod GET");
+		return 0;
+	}
+	if (sconf->method == AUTH_WEB_METHOD_POST &&
+	    sconf->body_format == AUTH_WEB_BODY_NONE) {
+		pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": AuthWebBodyFormat none can't be used with AuthWebMethod POST");
+		return 0;
+	}
+
+	sconf->max_url_len = 0;
+	for (i = 0; i < sconf->urls->nelts; ++i) {
+		size_t len = strlen(((struct auth_web_url *) sconf->urls->elts)[i].url);
+
+		if (len > sconf->max_url_len) {
+			sconf->max_url_len = len;
+		}
+	}
+
+	sconf->body_prefix_len = sconf->body_infix_len = sconf->body_suffix_len = 0;
+	if (sconf->body_format == AUTH_WEB_BODY_JSON) {
+		sconf->body_prefix = palloc(p, 6 * strlen(sconf->user_param_name) + 5);
+		memcpy(sconf->body_prefix, "{\"", 2);
+		sconf->body_prefix_len = 2 + auth_web_json_escape(sconf->body_prefix + 2,
+			sconf->user_param_name, strlen(sconf->user_param_name));
+		memcpy(sconf->body_prefix + sconf->body_prefix_len, "\":\"", 3);
+		sconf->body_prefix_len += 3;
+		sconf->body_infix = palloc(p, 6 * strlen(sconf->pass_param_name) + 6);
+		memcpy(sconf->body_infix, "\",\"", 3);
+		sconf->body_infix_len = 3 + auth_web_json_escape(sconf->body_infix + 3,
+			sconf->pass_param_name, strlen(sconf->pass_param_name));
+		memcpy(sconf->body_infix + sconf->body_infix_len, "\":\"", 3);
+		sconf->body_infix_len += 3;
+		sconf->body_suffix = "\"}";
+		sconf->body_suffix_len = 2;
+
+	} else if (sconf->body_format == AUTH_WEB_BODY_FORM) {
+		sconf->body_prefix = palloc(p, 3 * strlen(sconf->user_param_name) + 1);
+		sconf->body_prefix_len = auth_web_urlencode(sconf->body_prefix,
+			sconf->user_param_name, strlen(sconf->user_param_name));
+		sconf->body_prefix[sconf->body_prefix_len++] = '=';
+		sconf->body_infix = palloc(p, 3 * strlen(sconf->pass_param_name) + 2);
+		sconf->body_infix[0] = '&';
+		sconf->body_infix_len = 1 + auth_web_urlencode(sconf->body_infix + 1,
+			sconf->pass_param_name, strlen(sconf->pass_param_name));
+		sconf->body_infix[sconf->body_infix_len++] = '=';
+	}
+
+	auth_web_conf_headers(p, sconf);
+	return 1;
+}
+
+/* Adds key to a routing trie, one lowercased byte per level, walking it
+ * backwards for suffix routes. Children of a node are chained through
+ * sibling; index 0 is the root, so a child of 0 means none.
+ */
+static void
+auth_web_route_insert(array_header *trie, const char *key, size_t len,
+                      int reverse, int tenant, int exact)
+{
+	struct auth_web_route_node *node;
+	unsigned int cur = 0, next;
+	unsigned char ch;
+	register size_t i;
+
+	for (i = 0; i < len; ++i) {
+		ch = tolower((unsigned char) key[reverse ? len - 1 - i : i]);
+		node = (struct auth_web_route_node *) trie->elts;
+		for (next = node[cur].child; next && node[next].ch != ch;
+		     next = node[next].sibling);
+
+		if (!next) {
+			next = trie->nelts;
+			node = push_array(trie);
+			node->ch = ch;
+			node->child = 0;
+			node->tenant = node->exact = -1;
+			node = (struct auth_web_route_node *) trie->elts;
+			node[next].sibling = node[cur].child;
+			node[cur].child = next;
+		}
+		cur = next;
+	}
+
+	node = (struct auth_web_route_node *) trie->elts;
+	if (exact) {
+		node[cur].exact = tenant;
+	} else {
+		node[cur].tenant = tenant;
+	}
+}
+
+/* Returns the tenant of the longest route matching user, or -1, and the
+ * length of the match in depth.
+ */
+static int
+auth_web_route_walk(array_header *trie, const char *user, size_t len,
+                    int reverse, size_t *depth)
+{
+	struct auth_web_route_node *node = (struct auth_web_route_node *) trie->elts;
+	unsigned int cur = 0;
+	unsigned char ch;
+	int found = node[0].tenant;
+	register size_t i;
 
-static pr_regex_t *user_creg;
-static char *response_data;
+	*depth = 0;
+	for (i = 0; i < len; ++i) {
+		ch = tolower((unsigned char) user[reverse ? len - 1 - i : i]);
+		for (cur = node[cur].child; cur && node[cur].ch != ch;
+		     cur = node[cur].sibling);
+		if (!cur) {
+			return found;
+		}
+		if (node[cur].tenant >= 0) {
+			found = node[cur].tenant;
+			*depth = i + 1;
+		}
+	}
+	if (node[cur].exact >= 0) {
+		found = node[cur].exact;
+		*depth = len + 1;
+	}
+	return found;
+}
 
-module auth_web_module;
+/* Returns the configuration to use for user: that of the tenant whose
+ * route matches it, if any, otherwise the server's.
+ */
+static struct auth_web_conf *
+auth_web_route(const char *user)
+{
+	struct auth_web_routes *routes;
+	size_t len, prefix_depth, suffix_depth;
+	int prefix, suffix;
 
-static char *urlencode(pool *p, const char *str);
+	if (!server_conf || !server_conf->routes) {
+		return server_conf && server_conf->enabled ? server_conf : NULL;
+	}
 
+	routes = server_conf->routes;
+	len = strlen(user);
+	prefix = auth_web_route_walk(routes->prefix, user, len, FALSE, &prefix_depth);
+	suffix = auth_web_route_walk(routes->suffix, user, len, TRUE, &suffix_depth);
+	if (suffix >= 0 && (prefix < 0 || suffix_depth > prefix_depth)) {
+		prefix = suffix;
+	}
 
-MODRET
-handle_auth_web_getpwnam(cmd_rec *cmd)
+	if (prefix >= 0) {
+		return ((struct auth_web_conf **) routes->tenants->elts)[prefix];
+	}
+	return server_conf->enabled ? server_conf : NULL;
+}
+
+/* Splits a route file line into words. Double quotes group words, and a
+ * backslash within them escapes the next character. Returns the number of
+ * words, or -1 for an unterminated quote.
+ */
+static int
+auth_web_route_split(pool *p, const char *line, size_t len, array_header *words)
 {
-	struct passwd *pw;
+	const char *end = line + len;
+	char *word, *out;
+	int quoted;
 
-	if (!url || !user_param_name || !pass_param_name || !local_user ||
-	    !(failed_string || required_headers)) {
-		return PR_DECLINED(cmd);
-	}
-	if (user_creg) {
-		if (pr_regexp_exec(user_creg, cmd->argv[0], 0, NULL, 0, 0, 0) != 0) {
-			pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": user doesn't match regex");
-			return PR_DECLINED(cmd);
+	while (line < end) {
+		while (line < end && (*line == ' ' || *line == '\t' || *line == '\r')) {
+			++line;
+		}
+		if (line == end || (*line == '#' && words->nelts == 0)) {
+			break;
 		}
+
+		word = out = palloc(p, end - line + 1);
+		for (quoted = 0; line < end; ++line) {
+			if (quoted && *line == '\\' && line + 1 < end) {
+				*out++ = *++line;
+			} else if (*line == '"') {
+				quoted = !quoted;
+			} else if (!quoted && (*line == ' ' || *line == '\t' || *line == '\r')) {
+				break;
+			} else {
+				*out++ = *line;
+			}
+		}
+		if (quoted) {
+			return -1;
+		}
+		*out = 0;
+		*((char **) push_array(words)) = word;
 	}
+	return words->nelts;
+}
 
-	pw = pcalloc(session.pool, sizeof(struct passwd));
-	if (!pw) {
-		return PR_DECLINED(cmd);
+/* Applies one "key=value" setting of a route file line to tenant. Returns
+ * NULL on success, or a description of the problem. The first url,
+ * require_header, or rule replaces the inherited list rather than adding to
+ * it; seen tracks which have been replaced.
+ */
+static const char *
+auth_web_route_set(pool *p, struct auth_web_conf *tenant, char *setting,
+                   unsigned char *seen)
+{
+	char *value = strchr(setting, '=');
+
+	if (!value) {
+		return pstrcat(p, "expected key=value, not '", setting, "'", NULL);
 	}
+	*value++ = 0;
 
-	memcpy(pw, getpwnam(local_user), sizeof(struct passwd));
-	pw->pw_name = pstrdup(session.pool, cmd->argv[0]);
-	if (!pw->pw_name) {
-		return PR_DECLINED(cmd);
+	if (strcmp(setting, "url") == 0) {
+		struct auth_web_url *u;
+
+		if (!seen[0]) {
+			tenant->urls = make_array(p, 2, sizeof(struct auth_web_url));
+			seen[0] = 1;
+		}
+		u = push_array(tenant->urls);
+		u->url = value;
+		u->backend = NULL;
+
+	} else if (strcmp(setting, "username_param") == 0) {
+		tenant->user_param_name = value;
+
+	} else if (strcmp(setting, "password_param") == 0) {
+		tenant->pass_param_name = value;
+
+	} else if (strcmp(setting, "local_user") == 0) {
+		tenant->local_user = value;
+
+	} else if (strcmp(setting, "failed_string") == 0) {
+		tenant->failed_string = *value ? value : NULL;
+
+	} else if (strcmp(setting, "require_header") == 0) {
+		if (!seen[1]) {
+			tenant->required_headers = make_array(p, 1, sizeof(char *));
+			seen[1] = 1;
+		}
+		*((char **) push_array(tenant->required_headers)) = value;
+
+	} else if (strcmp(setting, "rule") == 0) {
+		const char *error;
+
+		if (!seen[2]) {
+			tenant->rules = make_array(p, 2, sizeof(struct auth_web_rule));
+			seen[2] = 1;
+		}
+		error = auth_web_rule_compile(p, value, push_array(tenant->rules));
+		if (error) {
+			return error;
+		}
+
+	} else {
+		return pstrcat(p, "unknown setting '", setting, "'", NULL);
 	}
-	return mod_create_data(cmd, pw);
+	return NULL;
 }
 
-static size_t
-get_response_headers(const void *buffer, const size_t size,
-                     const size_t nmemb, const void *userp)
+/* Loads an AuthWebRouteFile. Each line routes a username pattern to a
+ * tenant, whose settings default to those of the server:
+ *
+ *   *@example.com  url=https://login.example.com/ local_user=example
+ *   partner-*      url=https://partner.test/auth rule="status = 2xx"
+ *   admin          local_user=root
+ *
+ * A leading '*' matches by suffix, a trailing one by prefix, and a pattern
+ * without either matches the username exactly. The longest matching
+ * pattern wins. Lines with errors are logged and skipped.
+ *
+ * The file is read through a private mapping, and the routing tries are
+ * completely built before the server's configuration is published, so a
+ * reload never exposes a partial table.
+ */
+static struct auth_web_routes *
+auth_web_routes_load(pool *p, struct auth_web_conf *sconf, const char *path)
 {
-	char *str;
-	unsigned int copy_len;
+	struct auth_web_routes *routes;
+	struct auth_web_route_node *root;
+	struct auth_web_conf *tenant;
+	struct stat st;
+	array_header *words;
+	const char *map, *line, *eol, *error;
+	char *pattern;
+	unsigned char seen[3];
+	unsigned int lineno = 0;
+	size_t len;
+	int fd, n, bad;
+	register int i;
 
-	/* libcurl doesn't guarantee NULL termination, so make sure ourselves.
-	 * Don't copy the trailing CR/LF, if present.
-	 */
-	str = (char *) buffer;
-	copy_len = size * nmemb;
-	if (str[copy_len - 1] == '\r' || str[copy_len - 1] == '\n') {
-		--copy_len;
-	}
-	if (str[copy_len - 1] == '\r' || str[copy_len - 1] == '\n') {
-		--copy_len;
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to open AuthWebRouteFile %s: %s", path, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return NULL;
 	}
 
-	str = pstrndup(session.pool, str, copy_len);
-	if (!str) {
-		return 0;
+	map = NULL;
+	if (st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (map == MAP_FAILED) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to map AuthWebRouteFile %s: %s", path, strerror(errno));
+		return NULL;
 	}
-	pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": received response header: %s", (char *) str);
 
-	if (received_headers == NULL) {
-		/* 16 is an arbitrary, but probably reasonable, number. */
-		received_headers = make_array(session.pool, 16, sizeof(char *));
-		if (received_headers == NULL) {
-			return 0;
+	routes = pcalloc(p, sizeof(*routes));
+	routes->tenants = make_array(p, 16, sizeof(struct auth_web_conf *));
+	routes->prefix = make_array(p, 64, sizeof(struct auth_web_route_node));
+	routes->suffix = make_array(p, 64, sizeof(struct auth_web_route_node));
+	root = push_array(routes->prefix);
+	root->tenant = root->exact = -1;
+	root = push_array(routes->suffix);
+	root->tenant = root->exact = -1;
+
+	for (line = map; map && line < map + st.st_size; line = eol + 1) {
+		++lineno;
+		eol = memchr(line, '\n', map + st.st_size - line);
+		if (!eol) {
+			eol = map + st.st_size;
 		}
-	}
-	*((char **) push_array(received_headers)) = str;
 
-	return size * nmemb;
-}
+		words = make_array(p, 4, sizeof(char *));
+		n = auth_web_route_split(p, line, eol - line, words);
+		if (n == 0) {
+			continue;
+		}
+		if (n < 0) {
+			pr_log_pri(PR_LOG_WARNING, MOD_AUTH_WEB_VERSION ": %s:%u: unterminated quote, skipping", path, lineno);
+			continue;
+		}
 
-static size_t
-get_response_data(const void *buffer, const size_t size,
-                  const size_t nmemb, const void *userp)
-{
-	char *str;
+		tenant = palloc(p, sizeof(*tenant));
+		*tenant = *sconf;
+		tenant->next = NULL;
+		tenant->routes = NULL;
+		memset(seen, 0, sizeof(seen));
 
-	/* libcurl doesn't guarantee NULL termination, so make sure ourselves. 
-	 * We "leak" this since the pstrcat() below will allocate space as well,
-	 * but it's not a huge amount of memory and auth only happens once.
-	 * We could probably create a separate pool for this allocation, but
-	 * it doesn't seem worthwhile for a few KiB at most.
-	 */
-	str = pstrndup(session.pool, buffer, size * nmemb);
-	if (!str) {
-		return 0;
+		bad = 0;
+		for (i = 1; i < n && !bad; ++i) {
+			error = auth_web_route_set(p, tenant, ((char **) words->elts)[i], seen);
+			if (error) {
+				pr_log_pri(PR_LOG_WARNING, MOD_AUTH_WEB_VERSION ": %s:%u: %s, skipping", path, lineno, error);
+				bad = 1;
+			}
+		}
+		if (bad) {
+			continue;
+		}
+		if (!(tenant->enabled = auth_web_conf_finish(p, tenant))) {
+			pr_log_pri(PR_LOG_WARNING, MOD_AUTH_WEB_VERSION ": %s:%u: route lacks a URL, parameter names, local user, or success criteria, skipping", path, lineno);
+			continue;
+		}
+
+		pattern = ((char **) words->elts)[0];
+		len = strlen(pattern);
+		if (*pattern == '*') {
+			auth_web_route_insert(routes->suffix, pattern + 1, len - 1, TRUE,
+				routes->tenants->nelts, FALSE);
+		} else if (len > 0 && pattern[len - 1] == '*') {
+			auth_web_route_insert(routes->prefix, pattern, len - 1, FALSE,
+				routes->tenants->nelts, FALSE);
+		} else {
+			auth_web_route_insert(routes->prefix, pattern, len, FALSE,
+				routes->tenants->nelts, TRUE);
+		}
+		*((struct auth_web_conf **) push_array(routes->tenants)) = tenant;
 	}
 
-	response_data = pstrcat(session.pool, response_data, str, NULL);
-	return size * nmemb;
+	if (map) {
+		munmap((void *) map, st.st_size);
+	}
+	pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": loaded %u routes from %s", routes->tenants->nelts, path);
+	return routes;
 }
 
-static char *
-urlencode(pool *p, const char *str)
+static struct auth_web_conf *
+auth_web_conf_resolve(pool *p, server_rec *s)
 {
-	char *escaped, *check, *track;
-	unsigned int num_to_escape;
+	struct auth_web_conf *sconf;
+	config_rec *c;
+	char *path;
+	int *ttl, *timeout;
+	register int i;
+
+	sconf = pcalloc(p, sizeof(*sconf));
+	sconf->server = s;
 
-	num_to_escape = 0;
-	check = (char *) str;
-	while (*check) {
-		if (! (isalnum(*check) || *check == '-' || *check == '_' ||
-		       *check == '.' || *check == ' ')) {
+	for (c = find_config(s->conf, CONF_PARAM, "AuthWebURL", FALSE); c;
+	     c = find_config_next(c, c->next, CONF_PARAM, "AuthWebURL", FALSE)) {
+		for (i = 0; i < c->argc; ++i) {
+			struct auth_web_url *u;
 
-			++num_to_escape;
+			if (!sconf->urls) {
+				sconf->urls = make_array(p, 2, sizeof(struct auth_web_url));
+			}
+			u = push_array(sconf->urls);
+			u->url = c->argv[i];
+			u->backend = NULL;
 		}
-		++check;
 	}
+	sconf->user_param_name = (char *) get_param_ptr(s->conf,
+		"AuthWebUsernameParamName", FALSE);
+	sconf->pass_param_name = (char *) get_param_ptr(s->conf,
+		"AuthWebPasswordParamName", FALSE);
+	sconf->failed_string = (char *) get_param_ptr(s->conf,
+		"AuthWebLoginFailedString", FALSE);
+	sconf->local_user = (char *) get_param_ptr(s->conf,
+		"AuthWebLocalUser", FALSE);
+	sconf->user_match = (struct auth_web_user_match *) get_param_ptr(s->conf,
+		"AuthWebUserRegex", FALSE);
+	sconf->user_suffixes = auth_web_suffixes_create(p, s);
 
-	escaped = pcalloc(p, strlen(str) + (2 * num_to_escape) + 1);
+	if ((c = find_config(s->conf, CONF_PARAM, "AuthWebRequireHeader", FALSE)) != NULL) {
+		sconf->required_headers = make_array(p, 1, sizeof(char *));
+		do {
+			*((char **) push_array(sconf->required_headers)) = c->argv[0];
+		} while ((c = find_config_next(c, c->next, CONF_PARAM, "AuthWebRequireHeader", FALSE)));
+	}
 
-	check = (char *) str;
-	track = (char *) escaped;
-	while (*check) {
-		if (isalnum(*check) || *check == '-' || *check == '_' || *check == '.') {
-			*track = *check;
-		} else if (*check == ' ') {
-			*track = '+';
-		} else {
-			char in_hex[3];
-			snprintf(in_hex, 3, "%02x", *check);
-			*track++ = '%';
-			*track++ = in_hex[0];
-			*track   = in_hex[1];
+	for (c = find_config(s->conf, CONF_PARAM, "AuthWebRule", FALSE); c;
+	     c = find_config_next(c, c->next, CONF_PARAM, "AuthWebRule", FALSE)) {
+		if (!sconf->rules) {
+			sconf->rules = make_array(p, 4, sizeof(struct auth_web_rule));
 		}
-		++track;
-		++check;
+		*((struct auth_web_rule *) push_array(sconf->rules)) =
+			*((struct auth_web_rule *) c->argv[0]);
 	}
-	*track = 0;
 
-	return escaped;
-}
+	ttl = (int *) get_param_ptr(s->conf, "AuthWebCacheTTL", FALSE);
+	sconf->cache_ttl = ttl ? *ttl : 0;
+	ttl = (int *) get_param_ptr(s->conf, "AuthWebNegativeCacheTTL", FALSE);
+	sconf->neg_cache_ttl = ttl ? *ttl : 0;
+	ttl = (int *) get_param_ptr(s->conf, "AuthWebCacheSoftTTL", FALSE);
+	sconf->cache_soft_ttl = ttl ? *ttl : 0;
 
-MODRET
-handle_auth_web_auth(cmd_rec *cmd)
-{
-	const char *username = cmd->argv[0];
-	const char *password = cmd->argv[1];
-	char *escaped_username, *escaped_password, *post_data,
-		curl_error[CURL_ERROR_SIZE];
-	unsigned int post_data_len;
-	struct curl_slist *headers = NULL;
-	CURL *curl_handle;
-	CURLcode success;
+	timeout = (int *) get_param_ptr(s->conf, "AuthWebConnectTimeout", FALSE);
+	sconf->connect_timeout = timeout ? *timeout : AUTH_WEB_DEFAULT_CONNECT_TIMEOUT;
+	timeout = (int *) get_param_ptr(s->conf, "AuthWebTimeout", FALSE);
+	sconf->total_timeout = timeout ? *timeout : AUTH_WEB_DEFAULT_TIMEOUT;
+	timeout = (int *) get_param_ptr(s->conf, "AuthWebLowSpeedTimeout", FALSE);
+	sconf->low_speed_timeout = timeout ? *timeout : 0;
+	timeout = (int *) get_param_ptr(s->conf, "AuthWebBackendRetry", FALSE);
+	sconf->backend_retry = timeout ? *timeout : AUTH_WEB_DEFAULT_BACKEND_RETRY;
 
-	if (!url || !user_param_name || !pass_param_name || !local_user ||
-	    !(failed_string || required_headers)) {
-		return PR_DECLINED(cmd);
+	c = find_config(s->conf, CONF_PARAM, "AuthWebCircuitBreaker", FALSE);
+	if (c) {
+		sconf->breaker_failures = *((int *) c->argv[0]);
+		sconf->breaker_cooldown = *((int *) c->argv[1]);
+	}
+
+	c = find_config(s->conf, CONF_PARAM, "AuthWebEarlyAbort", FALSE);
+	sconf->early_abort = c ? *((int *) c->argv[0]) : FALSE;
+
+	timeout = (int *) get_param_ptr(s->conf, "AuthWebCoalesce", FALSE);
+	sconf->coalesce = timeout ? *timeout : 0;
+
+	timeout = (int *) get_param_ptr(s->conf, "AuthWebMaxConcurrent", FALSE);
+	sconf->max_concurrent = timeout ? *timeout : 0;
+	c = find_config(s->conf, CONF_PARAM, "AuthWebRateLimit", FALSE);
+	if (c) {
+		sconf->rate_limit = *((int *) c->argv[0]);
+		sconf->rate_burst = *((int *) c->argv[1]);
 	}
-	if (user_creg) {
-		if (pr_regexp_exec(user_creg, cmd->argv[0], 0, NULL, 0, 0, 0) != 0) {
-			pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": user doesn't match regex");
-			return PR_DECLINED(cmd);
+	timeout = (int *) get_param_ptr(s->conf, "AuthWebQueueTimeout", FALSE);
+	sconf->queue_timeout = timeout ? *timeout : AUTH_WEB_DEFAULT_QUEUE_TIMEOUT;
+	timeout = (int *) get_param_ptr(s->conf, "AuthWebHTTPVersion", FALSE);
+	sconf->http_version = timeout ? *timeout : AUTH_WEB_HTTP_DEFAULT;
+	timeout = (int *) get_param_ptr(s->conf, "AuthWebMaxResponseBytes", FALSE);
+	sconf->max_response_bytes = timeout ? *timeout : AUTH_WEB_DEFAULT_MAX_RESPONSE;
+	timeout = (int *) get_param_ptr(s->conf, "AuthWebMaxHeaders", FALSE);
+	sconf->max_headers = timeout ? *timeout : AUTH_WEB_DEFAULT_MAX_HEADERS;
+	timeout = (int *) get_param_ptr(s->conf, "AuthWebMethod", FALSE);
+	sconf->method = timeout ? *timeout : AUTH_WEB_METHOD_POST;
+	timeout = (int *) get_param_ptr(s->conf, "AuthWebBodyFormat", FALSE);
+	sconf->body_format = timeout ? *timeout : AUTH_WEB_BODY_FORM;
+	for (c = find_config(s->conf, CONF_PARAM, "AuthWebExtraHeader", FALSE); c;
+	     c = find_config_next(c, c->next, CONF_PARAM, "AuthWebExtraHeader", FALSE)) {
+		if (!sconf->extra_headers) {
+			sconf->extra_headers = make_array(p, 1, sizeof(char *));
 		}
+		*((char **) push_array(sconf->extra_headers)) = c->argv[0];
+	}
+	c = find_config(s->conf, CONF_PARAM, "AuthWebValidateURL", FALSE);
+	if (c) {
+		sconf->validate_url = c->argv[0];
+		sconf->cookie_ttl = *((int *) c->argv[1]);
 	}
 
-	escaped_username = urlencode(cmd->tmp_pool, username);
-	escaped_password = urlencode(cmd->tmp_pool, password);
+	sconf->enabled = auth_web_conf_finish(p, sconf);
 
-	curl_handle = curl_easy_init();
-	curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-	curl_easy_setopt(curl_handle, CURLOPT_ERRORBUFFER, curl_error);
-	curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, get_response_headers);
-	curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, get_response_data);
+	/* Tenants start from a copy of the finished server configuration. */
+	path = (char *) get_param_ptr(s->conf, "AuthWebRouteFile", FALSE);
+	if (path) {
+		sconf->routes = auth_web_routes_load(p, sconf, path);
+	}
+
+	if (!sconf->enabled && !sconf->routes) {
+		return NULL;
+	}
+	return sconf;
+}
+
+static void
+auth_web_confs_free(void)
+{
+	auth_web_confs = NULL;
+	if (auth_web_conf_pool) {
+		destroy_pool(auth_web_conf_pool);
+		auth_web_conf_pool = NULL;
+	}
+	if (auth_web_headers) {
+		curl_slist_free_all(auth_web_headers);
+		auth_web_headers = NULL;
+	}
+}
+
+static void
+auth_web_confs_init(void)
+{
+	struct auth_web_conf *sconf;
+	server_rec *s;
+
+	auth_web_confs_free();
 
 	/* Not strictly necessary, but some sites arbitrarily block "spiders,"
 	 * such as libcurl.
 	 */
-	headers = curl_slist_append(headers, pstrcat(cmd->tmp_pool, "User-Agent: ", MOD_AUTH_WEB_VERSION, NULL));
-	curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, headers);
+	auth_web_headers = curl_slist_append(NULL, "User-Agent: " MOD_AUTH_WEB_VERSION);
 
-	/* user_param_name=escaped_username&pass_param_name=escaped_password\0 */
-	post_data_len =
-		strlen(user_param_name) + 1 + strlen(escaped_username) + 1 +
-		strlen(pass_param_name) + 1 + strlen(escaped_password) + 1;
-	post_data = pcalloc(session.pool, post_data_len);
-	if (!post_data) {
-		return PR_DECLINED(cmd);
+	auth_web_conf_pool = make_sub_pool(permanent_pool);
+	for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+		sconf = auth_web_conf_resolve(auth_web_conf_pool, s);
+		if (sconf) {
+			sconf->next = auth_web_confs;
+			auth_web_confs = sconf;
+		}
 	}
-	snprintf(post_data, post_data_len, "%s=%s&%s=%s",
-		user_param_name, escaped_username,
-		pass_param_name, escaped_password);
-	curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, post_data);
+}
 
-	pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": calling URL %s with POST data %s", url, post_data);
-	success = curl_easy_perform(curl_handle);
-	if (success == CURLE_OK) {
-		pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": URL call succeeded");
-	} else {
-		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": URL call failed: %s",
-			curl_error);
-		return PR_DECLINED(cmd);
-	}
+static void
+auth_web_postparse_ev(const void *event_data, void *user_data)
+{
+	auth_web_cache_init();
+	auth_web_cookies_init();
+	auth_web_flights_init();
+	auth_web_confs_init();
+	auth_web_offline_init();
+	auth_web_backends_init();
+	auth_web_share_init();
+	auth_web_broker_start();
+	auth_web_warm_up();
+	auth_web_metrics_start();
+}
 
-	if (failed_string && response_data && strstr(response_data, failed_string)) {
-		pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": found failed string '%s' in response", failed_string);
-		return PR_ERROR_INT(cmd, PR_AUTH_BADPWD);
-	}
+static void
+auth_web_restart_ev(const void *event_data, void *user_data)
+{
+	auth_web_cookies_free();
+	auth_web_cache_free(&cache);
+	auth_web_cache_free(&neg_cache);
+	auth_web_flights_free();
+	auth_web_backends_free();
+	auth_web_offline_free();
+	auth_web_confs_free();
+	auth_web_share_free();
+	auth_web_broker_stop();
+	auth_web_metrics_stop();
+}
 
-	if (required_headers != NULL) {
-		register unsigned int i, j;
-		int found;
-		char **required = (char **) required_headers->elts,
-		     **received = (char **) received_headers->elts;
+#ifdef PR_USE_CTRLS
+static int auth_web_getconf(void);
 
-		for (i = 0; i < required_headers->nelts; ++i) {
-			pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": checking for header '%s' in response", required[i]);
-			found = 0;
+/* Verifies the username:password lines of path whose line number modulo
+ * nworkers is worker, exactly as logins would be, and caches those that
+ * succeed.
+ */
+static void
+auth_web_warm_worker(const char *path, unsigned int worker,
+                     unsigned int nworkers)
+{
+	FILE *fh;
+	pool *p;
+	char *line = NULL, *password, *hash;
+	size_t line_size = 0;
+	ssize_t len;
+	unsigned long lineno = 0, ok = 0, rejected = 0, declined = 0, skipped = 0,
+		too_long = 0;
 
-			for (j = 0; j < received_headers->nelts; ++j) {
-				if (strcmp(required[i], received[j]) == 0) {
-					found = 1;
-					break;
-				}
-			}
+	fh = fopen(path, "r");
+	if (!fh) {
+		pr_log_pri(PR_LOG_ERR, MOD_AUTH_WEB_VERSION ": unable to open %s: %s", path, strerror(errno));
+		return;
+	}
 
-			if (!found) {
-				pr_log_pri(PR_LOG_DEBUG, MOD_AUTH_WEB_VERSION ": couldn't find header '%s' in response", required[i]);
-				return PR_ERROR_INT(cmd, PR_AUTH_BADPWD);
+	/* Every line read, whatever becomes of it, is scrubbed before the next
+	 * is read over it.
+	 */
+	for (; (len = getline(&line, &line_size, fh)) >= 0;
+	     pr_memscrub(line, line_size)) {
+		if (lineno++ % nworkers != worker) {
+			continue;
+		}
+		if (len > AUTH_WEB_WARM_MAX_LINE) {
+			pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": line %lu of %s is longer than %d bytes, skipping", lineno, path, AUTH_WEB_WARM_MAX_LINE);
+			++too_long;
+			continue;
+		}
+		line[strcspn(line, "\r\n")] = 0;
+		if (*line == 0 || *line == '#') {
+			continue;
+		}
+		password = strchr(line, ':');
+		if (!password) {
+			++skipped;
+			continue;
+		}
+		*password++ = 0;
+
+		p = make_sub_pool(session.pool);
+		conf = auth_web_route(line);
+		if (!conf || conf->cache_ttl <= 0 || !auth_web_user_allowed(p, line) ||
+		    !(hash = auth_web_cache_hash(p, cache->salt, line, password))) {
+			++skipped;
+		} else {
+			switch (auth_web_login(p, line, password, NULL, hash)) {
+			case AUTH_WEB_LOGIN_OK:
+				++ok;
+				break;
+			case AUTH_WEB_LOGIN_REJECTED:
+				++rejected;
+				break;
+			default:
+				++declined;
+				break;
 			}
 		}
+		destroy_pool(p);
 	}
+	if (line) {
+		pr_memscrub(line, line_size);
+		free(line);
+	}
+	fclose(fh);
 
-	session.auth_mech = "mod_auth_web.c";
-	return PR_HANDLED(cmd);
+	pr_log_pri(PR_LOG_INFO, MOD_AUTH_WEB_VERSION ": cache warming worker %u: %lu cached, %lu rejected, %lu declined, %lu skipped, %lu too long",
+		worker, ok, rejected, declined, skipped, too_long);
 }
 
-MODRET
-set_config_value(cmd_rec *cmd)
+/* Starts a helper that runs nworkers processes over path; each works
+ * through its share of the lines one login at a time, so that verdicts
+ * come from the same code, and the same AuthWebMaxConcurrent and
+ * AuthWebRateLimit limits, as real logins.
+ */
+static pid_t
+auth_web_warm_start(const char *path, unsigned int nworkers, server_rec *s)
 {
-	CHECK_ARGS(cmd, 1);
-	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+	pid_t pid, *workers;
+	register unsigned int i;
 
-	add_config_param_str(cmd->argv[0], 1, cmd->argv[1]);
-	return PR_HANDLED(cmd);
+	pid = fork();
+	if (pid != 0) {
+		return pid;
+	}
+
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGALRM, SIG_DFL);
+	if (metrics_ctl_fd >= 0) {
+		close(metrics_ctl_fd);
+		metrics_ctl_fd = -1;
+	}
+
+	/* Look like a session of s; this also closes the broker's pipe. */
+	main_server = s;
+	if (!session.pool) {
+		session.pool = make_sub_pool(permanent_pool);
+	}
+	auth_web_getconf();
+	if (!server_conf) {
+		pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": mod_auth_web is not configured for %s", s->ServerName);
+		_exit(1);
+	}
+
+	workers = pcalloc(session.pool, nworkers * sizeof(pid_t));
+	for (i = 0; i < nworkers; ++i) {
+		workers[i] = fork();
+		if (workers[i] == 0) {
+			auth_web_warm_worker(path, i, nworkers);
+			_exit(0);
+		}
+		if (workers[i] < 0) {
+			pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": unable to fork cache warming worker: %s", strerror(errno));
+			break;
+		}
+	}
+	for (i = 0; i < nworkers && workers[i] > 0; ++i) {
+		while (waitpid(workers[i], NULL, 0) < 0 && errno == EINTR);
+	}
+
+	pr_log_pri(PR_LOG_INFO, MOD_AUTH_WEB_VERSION ": finished warming cache from %s", path);
+	_exit(0);
 }
 
-MODRET
-set_user_regex(cmd_rec *cmd)
+static int
+auth_web_handle_ctrls(pr_ctrls_t *ctrl, int reqargc, char **reqargv)
 {
-	pr_regex_t *creg;
+	server_rec *s = main_server;
+	char *endp;
+	long nworkers = AUTH_WEB_WARM_DEFAULT_WORKERS;
+	pid_t pid;
 
-	CHECK_ARGS(cmd, 1);
-	CHECK_CONF(cmd, CONF_ROOT | CONF_VIRTUAL | CONF_GLOBAL);
+	/* The helper reads any file as root, so only root may ask. */
+	if (ctrl->ctrls_cl->cl_uid != 0) {
+		pr_ctrls_add_response(ctrl, "access denied");
+		return -1;
+	}
+	if (reqargc < 2 || reqargc > 4 || strcmp(reqargv[0], "warm") != 0) {
+		pr_ctrls_add_response(ctrl, "usage: authweb warm file [workers [server-name]]");
+		return -1;
+	}
+	if (reqargc >= 3) {
+		nworkers = strtol(reqargv[2], &endp, 10);
+		if (*endp || nworkers < 1 || nworkers > AUTH_WEB_WARM_MAX_WORKERS) {
+			pr_ctrls_add_response(ctrl, "invalid number of workers: %s", reqargv[2]);
+			return -1;
+		}
+	}
+	if (reqargc == 4) {
+		for (s = (server_rec *) server_list->xas_list; s; s = s->next) {
+			if (s->ServerName && strcmp(s->ServerName, reqargv[3]) == 0) {
+				break;
+			}
+		}
+		if (!s) {
+			pr_ctrls_add_response(ctrl, "no server named %s", reqargv[3]);
+			return -1;
+		}
+	}
+	if (!cache) {
+		pr_ctrls_add_response(ctrl, "AuthWebCacheTTL is not configured");
+		return -1;
+	}
+	if (access(reqargv[1], R_OK) < 0) {
+		pr_ctrls_add_response(ctrl, "unable to read %s: %s", reqargv[1], strerror(errno));
+		return -1;
+	}
 
-	creg = pr_regexp_alloc(&auth_web_module);
-	if (pr_regexp_compile_posix(creg, cmd->argv[1], REG_ICASE | REG_EXTENDED | REG_NOSUB) != 0) {
-		CONF_ERROR(cmd, pstrcat(cmd->tmp_pool, cmd->argv[0], ": unable to compile regex '", cmd->argv[1], "'", NULL));
+	pid = auth_web_warm_start(reqargv[1], nworkers, s);
+	if (pid < 0) {
+		pr_ctrls_add_response(ctrl, "unable to fork: %s", strerror(errno));
+		return -1;
 	}
-	add_config_param(cmd->argv[0], 1, (void *) creg);
+	pr_ctrls_add_response(ctrl, "warming cache from %s in process %d", reqargv[1], (int) pid);
+	return 0;
+}
+#endif /* PR_USE_CTRLS */
 
-	return PR_HANDLED(cmd);
+static void
+auth_web_exit_ev(const void *event_data, void *user_data)
+{
+	auth_web_easy_handle_free();
+}
+
+static int
+auth_web_init(void)
+{
+	/* Once, in the daemon, rather than lazily in each session. */
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+
+	pr_event_register(&auth_web_module, "core.postparse", auth_web_postparse_ev, NULL);
+	pr_event_register(&auth_web_module, "core.restart", auth_web_restart_ev, NULL);
+#ifdef PR_USE_CTRLS
+	if (pr_ctrls_register(&auth_web_module, "authweb",
+	    "verify logins from a file into the cache", auth_web_handle_ctrls) < 0) {
+		pr_log_pri(PR_LOG_NOTICE, MOD_AUTH_WEB_VERSION ": unable to register 'authweb' control: %s", strerror(errno));
+	}
+#endif
+	return 0;
 }
 
 static int
 auth_web_getconf(void)
 {
-	config_rec *c;
+	unsigned int nrequired, nrules;
+	int need_body;
+	register unsigned int i;
 
-	url = (char *) get_param_ptr(main_server->conf, "AuthWebURL", FALSE);
-	user_param_name = (char *) get_param_ptr(main_server->conf,
-		"AuthWebUsernameParamName", FALSE);
-	pass_param_name = (char *) get_param_ptr(main_server->conf,
-		"AuthWebPasswordParamName", FALSE);
-	failed_string = (char *) get_param_ptr(main_server->conf,
-		"AuthWebLoginFailedString", FALSE);
-	local_user = (char *) get_param_ptr(main_server->conf,
-		"AuthWebLocalUser", FALSE);
-	user_creg = (pr_regex_t *) get_param_ptr(main_server->conf,
-		"AuthWebUserRegex", FALSE);
+	/* Only the daemon keeps the broker's and metrics writer's control
+	 * pipes open.
+	 */
+	if (broker_ctl_fd >= 0) {
+		close(broker_ctl_fd);
+		broker_ctl_fd = -1;
+	}
+	if (metrics_ctl_fd >= 0) {
+		close(metrics_ctl_fd);
+		metrics_ctl_fd = -1;
+	}
 
-	if ((c = find_config(main_server->conf, CONF_PARAM, "AuthWebRequireHeader", FALSE)) != NULL) {
-		required_headers = make_array(session.pool, 1, sizeof(char *));
-		do {
-			*((char **) push_array(required_headers)) = c->argv[0];
-		} while ((c = find_config_next(c, c->next, CONF_PARAM, "AuthWebRequireHeader", FALSE)));
+	for (server_conf = auth_web_confs; server_conf; server_conf = server_conf->next) {
+		if (server_conf->server == main_server) {
+			break;
+		}
+	}
+	if (!server_conf) {
+		return 0;
+	}
+
+	backend_seed = getpid() ^ time(NULL);
+	pr_event_register(&auth_web_module, "core.exit", auth_web_exit_ev, NULL);
+
+	/* Size the per-login state for the largest of the server's tenants. */
+	nrequired = server_conf->required_headers ? server_conf->required_headers->nelts : 0;
+	nrules = server_conf->rules ? server_conf->rules->nelts : 0;
+	need_body = server_conf->rules_need_body;
+	if (server_conf->routes) {
+		struct auth_web_conf **tenants =
+			(struct auth_web_conf **) server_conf->routes->tenants->elts;
+
+		for (i = 0; i < server_conf->routes->tenants->nelts; ++i) {
+			if (tenants[i]->required_headers && tenants[i]->required_headers->nelts > nrequired) {
+				nrequired = tenants[i]->required_headers->nelts;
+			}
+			if (tenants[i]->rules && tenants[i]->rules->nelts > nrules) {
+				nrules = tenants[i]->rules->nelts;
+			}
+			need_body |= tenants[i]->rules_need_body;
+		}
+	}
+	if (nrequired > 0) {
+		required_matched = pcalloc(session.pool, nrequired);
+	}
+	if (nrules > 0) {
+		rule_states = pcalloc(session.pool, nrules);
+	}
+	if (need_body) {
+		rule_body = palloc(session.pool, AUTH_WEB_RULE_BODY_MAX);
 	}
 
 	return 0;
 }
 
 static conftable auth_web_config[] = {
-	{ "AuthWebURL",               set_config_value, NULL },
-	{ "AuthWebUsernameParamName", set_config_value, NULL },
-	{ "AuthWebPasswordParamName", set_config_value, NULL },
-	{ "AuthWebLoginFailedString", set_config_value, NULL },
-	{ "AuthWebLocalUser",         set_config_value, NULL },
-	{ "AuthWebRequireHeader",     set_config_value, NULL },
-	{ "AuthWebUserRegex",         set_user_regex,   NULL },
-	{ NULL,                       NULL,             NULL }
+	{ "AuthWebURL",               set_url,                NULL },
+	{ "AuthWebUsernameParamName", set_config_value,       NULL },
+	{ "AuthWebPasswordParamName", set_config_value,       NULL },
+	{ "AuthWebLoginFailedString", set_config_value,       NULL },
+	{ "AuthWebLocalUser",         set_config_value,       NULL },
+	{ "AuthWebRequireHeader",     set_config_value,       NULL },
+	{ "AuthWebUserRegex",         set_user_regex,         NULL },
+	{ "AuthWebCacheTTL",          set_config_number,      NULL },
+	{ "AuthWebCacheSize",         set_cache_size,         NULL },
+	{ "AuthWebCacheEviction",     set_cache_eviction,     NULL },
+	{ "AuthWebNegativeCacheTTL",  set_config_number,      NULL },
+	{ "AuthWebBrokerSocket",      set_broker_socket,      NULL },
+	{ "AuthWebBrokerConnections", set_broker_connections, NULL },
+	{ "AuthWebTLSSessionCache",   set_tls_session_cache,  NULL },
+	{ "AuthWebConnectTimeout",    set_config_number,      NULL },
+	{ "AuthWebTimeout",           set_config_number,      NULL },
+	{ "AuthWebLowSpeedTimeout",   set_config_number,      NULL },
+	{ "AuthWebBackendRetry",      set_config_number,      NULL },
+	{ "AuthWebCircuitBreaker",    set_circuit_breaker,    NULL },
+	{ "AuthWebEarlyAbort",        set_config_boolean,     NULL },
+	{ "AuthWebRule",              set_rule,               NULL },
+	{ "AuthWebUserSuffix",        set_user_suffix,        NULL },
+	{ "AuthWebRouteFile",         set_route_file,         NULL },
+	{ "AuthWebCoalesce",          set_config_number,      NULL },
+	{ "AuthWebCacheSoftTTL",      set_config_number,      NULL },
+	{ "AuthWebMaxConcurrent",     set_max_concurrent,     NULL },
+	{ "AuthWebRateLimit",         set_rate_limit,         NULL },
+	{ "AuthWebQueueTimeout",      set_config_number,      NULL },
+	{ "AuthWebMetricsFile",       set_metrics_file,       NULL },
+	{ "AuthWebOfflineFile",       set_offline_file,       NULL },
+	{ "AuthWebHTTPVersion",       set_http_version,       NULL },
+	{ "AuthWebBrokerStreams",     set_broker_streams,     NULL },
+	{ "AuthWebWarmUp",            set_warm_up,            NULL },
+	{ "AuthWebValidateURL",       set_validate_url,       NULL },
+	{ "AuthWebMethod",            set_method,             NULL },
+	{ "AuthWebBodyFormat",        set_body_format,        NULL },
+	{ "AuthWebExtraHeader",       set_extra_header,       NULL },
+	{ "AuthWebMaxResponseBytes",  set_config_number,      NULL },
+	{ "AuthWebMaxHeaders",        set_config_number,      NULL },
+	{ NULL,                       NULL,                   NULL }
 };
 
 static authtable auth_web_auth[] = {
@@ -339,7 +6740,7 @@ module auth_web_module = {
 	auth_web_config,      /* Configuration handler table */
 	NULL,                 /* Command handler table */
 	auth_web_auth,        /* Authentication handler table */
-	NULL,                 /* Module init function */
+	auth_web_init,        /* Module init function */
 	auth_web_getconf,     /* Session init function */
 	MOD_AUTH_WEB_VERSION  /* Module version */
 };